@@ -32,9 +32,12 @@
  * $FreeBSD$
  */
 
+#define	_GNU_SOURCE	/* ppoll() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <fcntl.h>
@@ -44,8 +47,26 @@
 #include <assert.h>
 #include <sysexits.h>
 #include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
 #include <gpiod.h>
 
+#ifndef GPIOD_API
+#define	GPIOD_API	2
+#endif
+
 
 /******************************************************************************
  * Driver for the Hitachi HD44780.  This is probably *the* most common driver
@@ -61,8 +82,13 @@
  * P3        		Backlight control circuit
  * P4-P7      		Data, DB4-DB7
  *
- * FIXME: this driver never reads from the device and never checks busy flag.
- * Instead it uses fixed delays to wait for instruction completions.
+ * With the 8-bit data interface (-I 8) data lines DB0-DB7 are expected
+ * on eight consecutive pins starting at the first data pin, P4-P11 by
+ * default.
+ *
+ * By default this driver never reads from the device and never checks busy
+ * flag.  Instead it uses fixed delays to wait for instruction completions.
+ * With -P the R/W line is used to poll the busy flag before each access.
  */
 #define debug(lev, fmt, args...)	if (debuglevel >= lev) fprintf(stderr, fmt "\n" , ## args);
 
@@ -70,6 +96,9 @@ static void	usage(void);
 static char	*progname;
 
 #define	DEFAULT_DEVICE	"/dev/gpiochip1"
+#define	DEFAULT_I2C_DEVICE	"/dev/i2c-1"
+#define	HD_STATE_DIR	"/run"
+#define	HD_FRAME_IDLE_MS	50	/* producer done with a frame when idle */
 
 enum command {
 	CMD_RESET,
@@ -87,6 +116,39 @@ enum reg_type {
 	HD_DATA
 };
 
+#define	HD_BUSY_FLAG	0x80	/* in the value read from HD_COMMAND */
+
+#define	HD_CMD_CLEAR			0x01
+
+#define	HD_CMD_HOME			0x02
+
+#define	HD_CMD_ENTRYMODE		0x04
+#define		HD_ENTRY_INCR		0x02
+#define		HD_DISP_SHIFT		0x01
+
+#define	HD_CMD_DISPCTRL			0x08
+#define		HD_DISP_ON		0x04
+#define		HD_CURSOR_ON		0x02
+#define		HD_BLINK_ON		0x01
+
+#define	HD_CMD_MOVE			0x10
+#define		HD_MOVE_DISP		0x08
+#define		HD_MOVE_CURSOR		0x00
+#define		HD_MOVE_RIGHT		0x04
+#define		HD_MOVE_LEFT		0x00
+
+#define	HD_CMD_SETMODE			0x20
+#define		HD_MODE_8BIT_IF		0x10
+#define		HD_MODE_2LINES		0x08
+#define		HD_MODE_LARGE_FONT	0x04
+
+#define	HD_CMD_SET_CGADDR		0x40
+
+#define	HD_CMD_SET_ADDR			0x80
+
+#define	HD_LINE_DRAM_SIZE		40
+#define	HD_LINE1_DRAM_OFFSET		0x40
+
 enum hd_pin_id {
 	HD_PIN_DAT0 = 0,
 	HD_PIN_DAT1,
@@ -103,13 +165,192 @@ enum hd_pin_id {
 	HD_PIN_COUNT,
 };
 
+#define	HD_PIN_BIT(pin)		(1u << (pin))
+#define	HD_PIN_DATA_MASK(n)	(((1u << (n)) - 1) << HD_PIN_DAT0)
+
+#if GPIOD_API >= 2
+/*
+ * The lines on each chip are requested with a single line request, so
+ * that a complete bus state (RS, R/W, data and backlight) can be driven
+ * with one call per chip.  Values are kept by pin id.
+ */
+typedef struct {
+	int	nchips;
+	const char *name[HD_PIN_COUNT];	/* chip as given */
+	int	chipid[HD_PIN_COUNT];	/* chip of each pin */
+	unsigned int pinmask[HD_PIN_COUNT]; /* pins on each chip */
+	struct gpiod_chip *chip[HD_PIN_COUNT];
+	struct gpiod_line_request *req[HD_PIN_COUNT];
+	enum gpiod_line_value values[HD_PIN_COUNT]; /* last values written */
+} gpio_pins;
+#else
+/*
+ * The lines on each chip are normally requested as a single bulk, so that
+ * a complete bus state (RS, R/W, data and backlight) can be driven with one
+ * call per chip.  Line direction can only be changed for a whole bulk, so
+ * when the busy flag is read the data lines are requested as a bulk of
+ * their own.
+ */
+#define	HD_BULK_CTL	0
+#define	HD_BULK_DATA	1
+#define	HD_BULK(chip, kind)	((chip) * 2 + (kind))
+#define	HD_BULK_MAX	HD_BULK(HD_PIN_COUNT, 0)
+
 typedef struct {
-	struct gpiod_chip *chip;
-	struct gpiod_line *lines[HD_PIN_COUNT];
+	int	nchips;
+	const char *name[HD_PIN_COUNT];	/* chip as given */
+	int	chipid[HD_PIN_COUNT];	/* chip of each pin */
+	struct gpiod_chip *chip[HD_PIN_COUNT];
+	struct gpiod_line_bulk bulk[HD_BULK_MAX];
+	int	values[HD_BULK_MAX][HD_PIN_COUNT]; /* last values written */
+	int	bulkid[HD_PIN_COUNT];	/* bulk of each pin */
+	int	idx[HD_PIN_COUNT];	/* index in the bulk, -1 if unused */
 } gpio_pins;
+#endif
+
+/*
+ * PCF8574 I2C expander driven directly through /dev/i2c-N, pin numbers are
+ * its port bits.  Successive port states are queued and sent with a single
+ * I2C write, each byte takes effect on the port as it gets acknowledged.
+ */
+#define	HD_I2C_BUFSIZE		256
+#define	HD_I2C_PAD_USEC		100	/* pad shorter waits with idle bytes */
+
+typedef struct {
+	int	fd;
+	int	addr;
+	int	byte_usec;		/* time to transfer one byte */
+	uint8_t	port;			/* last port state queued */
+	uint8_t	datamap[256];		/* port bits for the data pins */
+	uint8_t	ctlmap[16];		/* port bits for RS, R/W, E and BL */
+	uint8_t	buf[HD_I2C_BUFSIZE];	/* port states not yet sent */
+	size_t	len;
+} i2c_expander;
+
+/*
+ * Simulated device, nothing is attached to the bus.  Reads return the
+ * data lines low, as from a controller that is never busy.
+ */
+typedef struct {
+	unsigned int	bits;		/* current bus state */
+	bool	data_in;		/* data lines are released */
+	unsigned long	writes;
+	unsigned long	reads;
+} sim_bus;
+
+/*
+ * Emulated controller.  The bus is decoded on every E edge, the way an
+ * HD44780 latches it, and each instruction keeps it busy for as long as
+ * the timing table says.  Accesses the controller would miss are counted.
+ */
+#define	HD_EMU_DDRAM_SIZE	0x80
+#define	HD_EMU_CGRAM_SIZE	0x40
+
+typedef struct {
+	unsigned int	bits;		/* current bus state */
+	bool	data_in;		/* data lines are released */
+	bool	if8;			/* 8-bit interface */
+	bool	lownib;			/* low nibble transfer is next */
+	uint8_t	hinib;			/* high nibble already written */
+	uint8_t	out;			/* register being read */
+	uint8_t	mode;			/* last function set */
+	uint8_t	entry;			/* last entry mode set */
+	uint8_t	dispctl;		/* last display control */
+	bool	cgsel;			/* address counter is in CGRAM */
+	uint8_t	ac;			/* address counter */
+	int	shift;			/* display shifted left by */
+	int	fsets;			/* function sets since power on */
+	uint8_t	ddram[HD_EMU_DDRAM_SIZE];
+	uint8_t	cgram[HD_EMU_CGRAM_SIZE];
+	uint64_t	busy_until;	/* monotonic ns */
+	uint64_t	t_ctl;		/* RS, R/W last changed */
+	uint64_t	t_rise;		/* E last went high */
+	uint64_t	t_fall;		/* E last went low */
+	unsigned long	instrs;
+	unsigned long	writes;
+	unsigned long	reads;
+	unsigned long	busy_errs;	/* accesses while busy */
+	unsigned long	timing_errs;	/* bus timing violations */
+} hd_emu;
+
+/*
+ * Controller timing, instruction execution times are for the nominal
+ * oscillator frequency given in the respective datasheet.
+ */
+struct hd_timing {
+	const char	*name;
+	unsigned int	power_on_us;	/* Vcc rise to first instruction */
+	unsigned int	reset1_us;	/* after the first function set */
+	unsigned int	reset2_us;	/* after the second function set */
+	unsigned int	clear_us;	/* clear display */
+	unsigned int	home_us;	/* return home */
+	unsigned int	exec_us;	/* any other instruction */
+	unsigned int	data_us;	/* data write, incl. address update */
+	unsigned int	setup_ns;	/* RS, R/W setup to E rise (tAS) */
+	unsigned int	pulse_ns;	/* E pulse width (PW_EH) */
+	unsigned int	hold_ns;	/* RS, R/W, data hold after E fall */
+	unsigned int	cycle_ns;	/* E cycle time (tcycE) */
+};
+
+static const struct hd_timing hd_timings[] = {
+	{ "hd44780",	40000, 4100, 100, 1520, 1520, 37, 41,  60, 450, 20, 1000 },
+	{ "st7066u",	40000, 4100, 100, 1520, 1520, 37, 41,   0, 460, 10, 1200 },
+	{ "ks0066",	30000, 4100, 100, 1530, 1530, 39, 43,  60, 450, 20, 1000 },
+	{ "splc780d",	40000, 4100, 100, 1520, 1520, 37, 41,  40, 450, 10, 1000 },
+	{ NULL }
+};
+
+/*
+ * Bus statistics, printed on exit with -t.
+ */
+struct hd_stats {
+	uint64_t	start;		/* process start, monotonic ns */
+	unsigned long	writes;		/* bus states set */
+	unsigned long	reads;		/* bus states read */
+	unsigned long	dirs;		/* data line direction changes */
+	unsigned long	syscalls;	/* for bus access and sleeping */
+	unsigned long	sleeps;
+	uint64_t	wait_ns;	/* time spent waiting on the bus */
+	uint64_t	idle_ns;	/* time spent waiting for input */
+	uint64_t	first;		/* first character written, ns */
+	unsigned long	chars;		/* input characters */
+	unsigned long	errors;		/* failed bus accesses */
+	uint64_t	ready;		/* display set up, monotonic ns */
+	unsigned long	ready_writes;	/* writes and syscalls until then */
+	unsigned long	ready_syscalls;
+};
+
+struct hd44780_state;
+
+/*
+ * Bus backend, everything that touches the hardware goes through one of
+ * these.  Pin states are given as masks of HD_PIN_BIT()s.
+ */
+struct hd_bus {
+	const char	*name;
+	const char	*device;	/* default device */
+	void	(*open)(char *devname, struct hd44780_state *state);
+	void	(*close)(struct hd44780_state *state);
+	void	(*set_pins)(struct hd44780_state *state, unsigned int mask,
+		    unsigned int bits);
+	/* Reading the bus, NULL if the backend can't. */
+	unsigned int (*get_pins)(struct hd44780_state *state,
+		    unsigned int mask);
+	void	(*data_dir)(struct hd44780_state *state, bool output);
+	/*
+	 * Backends that queue writes, each of which takes longer than any
+	 * E timing.  NULL if writes go out immediately.
+	 */
+	void	(*flush)(struct hd44780_state *state);
+	void	(*pad)(struct hd44780_state *state, useconds_t usec);
+};
 
 static struct hd44780_state {
+	const struct hd_bus *hd_bus;
 	gpio_pins	hd_gpio;
+	i2c_expander	hd_i2c;
+	sim_bus		hd_sim;
+	hd_emu		hd_emu;
 	int	hd_ifwidth;
 	int	hd_lines;
 	int	hd_cols;
@@ -117,9 +358,30 @@ static struct hd44780_state {
 	int 	hd_cursor;
 	int	hd_font;
 	int	hd_bl_on;
+	int	hd_busyflag;	/* poll busy flag instead of fixed delays */
+	int	hd_bf_ready;	/* interface is set up, busy flag is readable */
+	unsigned int hd_bus_bits; /* bus state last written */
+	unsigned int hd_bus_known; /* pins known to be in hd_bus_bits state */
+	uint64_t hd_busy_until;	/* controller busy until, monotonic ns */
+	uint64_t hd_bus_time;	/* last pin write issued, monotonic ns */
+	unsigned int hd_spin_us; /* spin instead of sleeping up to this long */
+	unsigned int hd_wake_ns; /* how late a sleep typically wakes up */
 	int	hd_col;
 	int	hd_row;
+	int	hd_addr;	/* controller address counter, -1 if unknown */
+	int	hd_clear;	/* frame buffer cleared since the last flush */
+	uint8_t	*hd_fb;		/* wanted screen contents */
+	uint8_t	*hd_ddram;	/* screen contents as known to be displayed */
 	int	pins[HD_PIN_COUNT];
+	char	*pinchip[HD_PIN_COUNT]; /* chip of each pin, NULL for -f */
+	int	esc;		/* input is in an escape sequence */
+	const struct hd_timing *hd_timing;
+	int	hd_showstats;	/* print hd_stats on exit */
+	int	hd_attach;	/* take over the display as it is */
+	int	hd_coalesce;	/* only show the newest of pending frames */
+	int	hd_scroll;	/* scroll up at a newline on the last line */
+	char	hd_statefile[PATH_MAX]; /* what's displayed, "" if none */
+	struct hd_stats hd_stats;
 } hd44780_state;
 
 /* Driver functions */
@@ -127,8 +389,27 @@ static void	hd44780_prepare(char *devname, struct hd44780_state * state);
 static void	hd44780_finish(void);
 static void	hd44780_command(struct hd44780_state *state, enum command cmd);
 static void	hd44780_putc(struct hd44780_state *state, int c);
-
+static void	hd44780_pad(struct hd44780_state *state, int n);
+static void	hd44780_flush(struct hd44780_state *state);
+static void	hd44780_state_path(struct hd44780_state *state, char *devname);
+static bool	hd44780_state_load(struct hd44780_state *state);
+static void	hd44780_state_save(struct hd44780_state *state);
+static const struct hd_bus *hd44780_bus_lookup(const char *name);
+static uint64_t	hd44780_now(void);
+static void	hd44780_bus_error(struct hd44780_state *state,
+		    const char *func);
+
+static const char *chip_name(const char *name);
+static char	*parse_pin(struct hd44780_state *state, enum hd_pin_id pin,
+		    char *arg);
+static void	set_realtime(void);
+static bool	input_pending(int fd, int msec);
+static int	wait_input(int fd, int lfd, int msec);
 static void	do_char(struct hd44780_state *state, char ch);
+static void	do_input(struct hd44780_state *state, int fd, int lfd);
+static void	serve(struct hd44780_state *state, char *sockpath,
+		    bool realtime);
+static void	send_to_server(char *sockpath, int argc, char *argv[]);
 
 static int	debuglevel = 0;
 
@@ -139,8 +420,15 @@ main(int argc, char *argv[])
 	extern char	*optarg;
 	extern int	optind;
 	char		*cp, *endp;
-	char		*devname = DEFAULT_DEVICE;
-	int		ch, i;
+	char		*devname = NULL;
+	char		*sockpath = NULL;
+	char		*timing = NULL;
+	char		*bus = NULL;
+	char		*datapins = "4";
+	bool		server = false;
+	bool		realtime = false;
+	int		ch, i, j, n;
+	long		spin;
 
 	if ((progname = strrchr(argv[0], '/'))) {
 		progname++;
@@ -148,20 +436,37 @@ main(int argc, char *argv[])
 		progname = argv[0];
 	}
 
+	state->hd_stats.start = hd44780_now();
 	state->hd_bl_on = 1;
 	state->hd_lines = 2;
 	state->hd_cols = 16;
 	state->hd_ifwidth = 4;
+	state->hd_spin_us = 100;
+	state->hd_i2c.fd = -1;
+	state->hd_i2c.addr = -1;
 	for (i = 0; i < HD_PIN_COUNT; i++)
 		state->pins[i] = -1;
 	state->pins[HD_PIN_RS] = 0;
 	state->pins[HD_PIN_RW] = 1;
 	state->pins[HD_PIN_E] = 2;
 	state->pins[HD_PIN_BL] = 3;
-	state->pins[HD_PIN_DAT0] = 4;
 
-	while ((ch = getopt(argc, argv, "BCdD:E:f:Fh:I:L:OR:w:W:")) != -1) {
+	while ((ch = getopt(argc, argv, "aA:b:BcCdD:E:f:Fh:I:lL:OPrR:s:S:tT:u:w:W:")) != -1) {
 		switch(ch) {
+		case 'A':
+			state->hd_i2c.addr = strtol(optarg, &endp, 0);
+			if (*endp != '\0' || state->hd_i2c.addr < 0 ||
+			    state->hd_i2c.addr > 0x7f) {
+				fprintf(stderr, "invalid I2C address %s\n", optarg);
+				usage();
+			}
+			break;
+		case 'a':
+			state->hd_attach = 1;
+			break;
+		case 'b':
+			bus = optarg;
+			break;
 		case 'd':
 			debuglevel++;
 			break;
@@ -185,15 +490,47 @@ main(int argc, char *argv[])
 		case 'B':
 			state->hd_blink = 1;
 			break;
+		case 'c':
+			state->hd_coalesce = 1;
+			break;
 		case 'C':
 			state->hd_cursor = 1;
 			break;
 		case 'F':
 			state->hd_font = 1;
 			break;
+		case 'l':
+			state->hd_scroll = 1;
+			break;
 		case 'O':
 			state->hd_bl_on = 0;
 			break;
+		case 'P':
+			state->hd_busyflag = 1;
+			break;
+		case 't':
+			state->hd_showstats = 1;
+			break;
+		case 'T':
+			timing = optarg;
+			break;
+		case 'r':
+			realtime = true;
+			break;
+		case 'u':
+			spin = strtol(optarg, &endp, 10);
+			if (*endp != '\0' || spin < 0 || spin > INT_MAX) {
+				fprintf(stderr, "invalid spin threshold %s\n", optarg);
+				usage();
+			}
+			state->hd_spin_us = spin;
+			break;
+		case 'S':
+			server = true;
+			/* FALLTHROUGH */
+		case 's':
+			sockpath = optarg;
+			break;
 		case 'I':
 			state->hd_ifwidth = strtol(optarg, &endp, 10);
 			if (*endp != '\0') {
@@ -202,39 +539,35 @@ main(int argc, char *argv[])
 			}
 			break;
 		case 'R':
-			state->pins[HD_PIN_RS] = strtol(optarg, &endp, 10);
-			if (*endp != '\0') {
+			endp = parse_pin(state, HD_PIN_RS, optarg);
+			if (endp == NULL || *endp != '\0') {
 				fprintf(stderr, "invalid pin specification %s\n", optarg);
 				usage();
 			}
 			break;
 		case 'W':
-			state->pins[HD_PIN_RW] = strtol(optarg, &endp, 10);
-			if (*endp != '\0') {
+			endp = parse_pin(state, HD_PIN_RW, optarg);
+			if (endp == NULL || *endp != '\0') {
 				fprintf(stderr, "invalid pin specification %s\n", optarg);
 				usage();
 			}
 			break;
 		case 'E':
-			state->pins[HD_PIN_E] = strtol(optarg, &endp, 10);
-			if (*endp != '\0') {
+			endp = parse_pin(state, HD_PIN_E, optarg);
+			if (endp == NULL || *endp != '\0') {
 				fprintf(stderr, "invalid pin specification %s\n", optarg);
 				usage();
 			}
 			break;
 		case 'L':
-			state->pins[HD_PIN_BL] = strtol(optarg, &endp, 10);
-			if (*endp != '\0') {
+			endp = parse_pin(state, HD_PIN_BL, optarg);
+			if (endp == NULL || *endp != '\0') {
 				fprintf(stderr, "invalid pin specification %s\n", optarg);
 				usage();
 			}
 			break;
 		case 'D':
-			state->pins[HD_PIN_DAT0] = strtol(optarg, &endp, 10);
-			if (*endp != '\0') {
-				fprintf(stderr, "invalid pin specification %s\n", optarg);
-				usage();
-			}
+			datapins = optarg;
 			break;
 		default:
 			usage();
@@ -243,12 +576,36 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (state->hd_ifwidth != 4) {
+	if (sockpath != NULL && !server) {
+		send_to_server(sockpath, argc, argv);
+		exit(EX_OK);
+	}
+
+	if (state->hd_ifwidth != 4 && state->hd_ifwidth != 8) {
 		fprintf(stderr, "Unsupported data interface width %d\n", state->hd_ifwidth);
 		usage();
 	}
-	for (i = 1; i < state->hd_ifwidth; i++) {
-		state->pins[HD_PIN_DAT0 + i] = state->pins[HD_PIN_DAT0] + i;
+	/* Either the first of consecutive data pins, or all of them. */
+	n = 0;
+	for (cp = datapins; cp != NULL; cp = (*endp == ',') ? endp + 1 : NULL) {
+		if (n == state->hd_ifwidth ||
+		    (endp = parse_pin(state, HD_PIN_DAT0 + n, cp)) == NULL ||
+		    (*endp != '\0' && *endp != ',')) {
+			fprintf(stderr, "invalid data pin specification %s\n",
+			    datapins);
+			usage();
+		}
+		n++;
+	}
+	if (n == 1) {
+		for (i = 1; i < state->hd_ifwidth; i++) {
+			state->pins[HD_PIN_DAT0 + i] = state->pins[HD_PIN_DAT0] + i;
+			state->pinchip[HD_PIN_DAT0 + i] =
+			    state->pinchip[HD_PIN_DAT0];
+		}
+	} else if (n != state->hd_ifwidth) {
+		fprintf(stderr, "%d data pins are needed\n", state->hd_ifwidth);
+		usage();
 	}
 
 	if (state->hd_lines != 1 && state->hd_lines != 2 && state->hd_lines != 4) {
@@ -264,8 +621,83 @@ main(int argc, char *argv[])
 		fprintf(stderr, "Backlight pin is not specified\n");
 		usage();
 	}
+	if (state->hd_i2c.addr != -1) {
+		for (i = 0; i < HD_PIN_COUNT; i++) {
+			if (state->pins[i] > 7) {
+				fprintf(stderr, "Pin %d is not on the I2C expander\n",
+				    state->pins[i]);
+				usage();
+			}
+		}
+	}
+	state->hd_timing = &hd_timings[0];
+	if (timing != NULL) {
+		for (i = 0; hd_timings[i].name != NULL; i++) {
+			if (strcasecmp(timing, hd_timings[i].name) == 0)
+				break;
+		}
+		if (hd_timings[i].name == NULL) {
+			fprintf(stderr, "Unknown controller %s\n", timing);
+			usage();
+		}
+		state->hd_timing = &hd_timings[i];
+	}
+	if (state->hd_spin_us > state->hd_timing->power_on_us) {
+		fprintf(stderr, "Spin threshold is longer than the %u us "
+		    "power-on wait\n", state->hd_timing->power_on_us);
+		usage();
+	}
+	if (bus == NULL)
+		bus = (state->hd_i2c.addr != -1) ? "i2c" : "gpiod";
+	if ((state->hd_bus = hd44780_bus_lookup(bus)) == NULL) {
+		fprintf(stderr, "Unknown bus %s\n", bus);
+		usage();
+	}
+	if (strcmp(state->hd_bus->name, "i2c") == 0 &&
+	    state->hd_i2c.addr == -1) {
+		fprintf(stderr, "I2C address is not specified\n");
+		usage();
+	}
+	if (devname == NULL)
+		devname = (char *)state->hd_bus->device;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if (state->pinchip[i] != NULL &&
+		    strcmp(state->hd_bus->name, "gpiod") != 0) {
+			fprintf(stderr, "Pins on other chips need the gpiod bus\n");
+			usage();
+		}
+	}
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		for (j = i + 1; j < HD_PIN_COUNT; j++) {
+			if (state->pins[i] != -1 &&
+			    state->pins[i] == state->pins[j] &&
+			    (state->pinchip[i] == state->pinchip[j] ||
+			    strcmp(chip_name(state->pinchip[i] ?
+			    state->pinchip[i] : devname),
+			    chip_name(state->pinchip[j] ?
+			    state->pinchip[j] : devname)) == 0)) {
+				fprintf(stderr, "Pin %d is used twice\n",
+				    state->pins[i]);
+				usage();
+			}
+		}
+	}
+	if (state->hd_busyflag && state->pins[HD_PIN_RW] == -1) {
+		fprintf(stderr, "R/W pin is required for busy flag polling\n");
+		usage();
+	}
+	if (state->hd_busyflag && state->hd_bus->get_pins == NULL) {
+		fprintf(stderr, "Bus %s can't read the busy flag\n",
+		    state->hd_bus->name);
+		usage();
+	}
 
+	if (realtime)
+		set_realtime();
 	hd44780_prepare(devname, state);
+	state->hd_stats.ready = hd44780_now();
+	state->hd_stats.ready_writes = state->hd_stats.writes;
+	state->hd_stats.ready_syscalls = state->hd_stats.syscalls;
 	atexit(hd44780_finish);
 
 	if (argc > 0) {
@@ -273,12 +705,15 @@ main(int argc, char *argv[])
 		for (i = 0; i < argc; i++)
 			for (cp = argv[i]; *cp; cp++)
 				do_char(state, *cp);
+	} else if (server) {
+		/* Nothing to show until a client connects. */
 	} else {
 		debug(2, "reading input from stdin");
-		setvbuf(stdin, NULL, _IONBF, 0);
-		while ((ch = fgetc(stdin)) != EOF)
-			do_char(state, (char)ch);
+		do_input(state, STDIN_FILENO, -1);
 	}
+	hd44780_flush(state);
+	if (server)
+		serve(state, sockpath, realtime);
 	exit(EX_OK);
 }
 
@@ -286,25 +721,47 @@ static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: %s [-f device] [-d] [-B] [-C] [-F] [-O] "
+	fprintf(stderr, "usage: %s [-a] [-b bus] [-f device] [-A addr] [-d] [-B] [-c] [-C] [-F] [-l] [-O] [-P] [-r] "
 	    "[-h <n>] [-w <n>] [-R <n>]\n"
-	    "\t[-W <n>] [-E <n>] [-L <n>] [-D <n>] [-I <n>] [args...]\n",
-	    progname);
+	    "\t[-W <n>] [-E <n>] [-L <n>] [-D <n>] [-I <n>] [-T controller]\n"
+	    "\t[-t] [-u <usec>] [-S socket] [args...]\n"
+	    "       %s -s socket [args...]\n",
+	    progname, progname);
 	fprintf(stderr, "Supported hardware: Hitachi HD44780 and compatibles\n");
+	fprintf(stderr, "   -a      Attach to the display without a reset if it's still set\n"
+			"           up as left by the last run\n");
 	fprintf(stderr, "   -d      Increase debugging\n");
+	fprintf(stderr, "   -b <b>  Bus: gpiod (default), i2c, sim (nothing attached)\n"
+			"           or emu (emulated controller)\n");
 	fprintf(stderr, "   -f      Specify device, default is '%s'\n", DEFAULT_DEVICE);
+	fprintf(stderr, "   -A <n>  Drive a PCF8574 at I2C address n directly, "
+	    "default device is '%s'\n", DEFAULT_I2C_DEVICE);
 	fprintf(stderr, "   -h <n>  n-line display (default 2)\n"
 			"   -w <n>  n-column display (default 16)\n"
 			"   -B      Cursor blink enable\n"
+			"   -c      Coalesce frames, skip older input up to the newest\n"
+			"           <FF> when the display falls behind\n"
 			"   -C      Cursor enable\n"
 			"   -F      Large font select\n"
-			"   -R <n>  R/S pin number (default 0)\n"
+			"   -l      Scroll up at a newline on the last line\n"
+			"   -R <n>  R/S pin number (default 0), pins can be given as\n"
+			"           chip:n for lines on another chip than the device\n"
 			"   -W <n>  R/W pin number (default 1)\n"
 			"   -E <n>  E pin number (default 2)\n"
 			"   -L <n>  Backlight pin number (default 3)\n"
 			"   -O      Turn backlight off (default on)\n"
-			"   -D <n>  First data pin number (default 4)\n"
-			"   -I <n>  Data interface width (only 4 is supported)\n");
+			"   -P      Poll busy flag instead of using fixed delays\n"
+			"   -r      Use real-time scheduling for precise bus timing\n"
+			"   -t      Print bus statistics on exit\n"
+			"   -u <n>  Busy-wait instead of sleeping for waits up to n us\n"
+			"           (default 100, 0 to always sleep)\n"
+			"   -D <n>  First data pin number (default 4), or a comma\n"
+			"           separated list of all data pins, lowest first\n"
+			"   -I <n>  Data interface width, 4 or 8 (default 4)\n"
+			"   -T <c>  Controller timing: hd44780 (default), st7066u,\n"
+			"           ks0066 or splc780d\n"
+			"   -S <p>  Keep the display open and serve clients on socket p\n"
+			"   -s <p>  Pass input to the server on socket p\n");
 	fprintf(stderr, "  args     Message strings.\n");
 	fprintf(stderr, "           Some ASCII control characters and escapes sequences are supported:\n");
 	fprintf(stderr, "                  <BS> (\\b)	Backspace\n");
@@ -319,12 +776,338 @@ usage(void)
 	exit(EX_USAGE);
 }
 
+/*
+ * A chip can be given by name or as a path in /dev, go by the name so
+ * that both compare equal.
+ */
+static const char *
+chip_name(const char *name)
+{
+
+	if (strncmp(name, "/dev/", 5) == 0)
+		return (name + 5);
+	return (name);
+}
+
+/*
+ * Parse a pin given as "[chip:]offset", return where it ends or NULL if
+ * it's invalid.
+ */
+static char *
+parse_pin(struct hd44780_state *state, enum hd_pin_id pin, char *arg)
+{
+	char *colon, *cp, *endp;
+
+	cp = arg;
+	state->pinchip[pin] = NULL;
+	colon = strchr(arg, ':');
+	if (colon != NULL && (strchr(arg, ',') == NULL ||
+	    colon < strchr(arg, ','))) {
+		if ((state->pinchip[pin] = strndup(arg, colon - arg)) == NULL)
+			err(EX_OSERR, "can't allocate chip name");
+		cp = colon + 1;
+	}
+	state->pins[pin] = strtol(cp, &endp, 10);
+	if (endp == cp)
+		return (NULL);
+	return (endp);
+}
+
+/*
+ * Keep the scheduler and page faults from stretching the bus timing:
+ * run SCHED_FIFO, with memory locked and timers expiring when asked to.
+ */
+static void
+set_realtime(void)
+{
+	struct sched_param sp;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1)
+		warn("can't switch to SCHED_FIFO");
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		warn("can't lock memory");
+	if (prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL) == -1)
+		warn("can't set timer slack");
+}
+
+static volatile sig_atomic_t quit;
+static sigset_t serve_mask;	/* signal mask while waiting for input */
+
+/*
+ * Check whether more input can be read within msec.
+ */
+static bool
+input_pending(int fd, int msec)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	return (poll(&pfd, 1, msec) > 0);
+}
+
+/*
+ * Wait up to msec, or without limit if negative, for input on fd.  Returns
+ * 1 if there is some, 0 if the time ran out and -1 if instead another
+ * client connects to the listening socket lfd, if there is one, or on a
+ * signal.  The signals that stop the server are only let through while
+ * waiting.
+ */
+static int
+wait_input(int fd, int lfd, int msec)
+{
+	struct pollfd pfd[2];
+	struct timespec ts;
+	int n;
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = lfd;	/* ignored if -1 */
+	pfd[1].events = POLLIN;
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000L;
+	if ((n = ppoll(pfd, 2, msec < 0 ? NULL : &ts, &serve_mask)) == -1)
+		return (-1);
+	if (n == 0)
+		return (0);
+	return (pfd[0].revents != 0 || (pfd[1].revents & POLLIN) == 0 ?
+	    1 : -1);
+}
+
+static void
+sig_quit(int sig)
+{
+
+	quit = 1;
+}
+
+static int
+sock_addr(struct sockaddr_un *sun, char *sockpath)
+{
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(sockpath) >= sizeof(sun->sun_path))
+		errx(EX_USAGE, "socket path too long: %s", sockpath);
+	strcpy(sun->sun_path, sockpath);
+	return (socket(AF_UNIX, SOCK_STREAM, 0));
+}
+
+/*
+ * Keep the display open and apply whatever clients connecting to the
+ * socket send, one client at a time.  A client that is idle when the next
+ * one connects is disconnected, so one that never closes its connection
+ * can't lock out the others.  Each client starts outside of an escape
+ * sequence.
+ */
+static void
+serve(struct hd44780_state *state, char *sockpath, bool realtime)
+{
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	struct pollfd pfd;
+	struct stat sb;
+	sigset_t stop;
+	uint64_t start;
+	int c, n, s;
+
+	if ((s = sock_addr(&sun, sockpath)) == -1)
+		err(EX_OSERR, "socket");
+	/* Only replace a stale socket, nothing else. */
+	if (lstat(sockpath, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode))
+			errx(EX_CANTCREAT, "'%s' exists and is not a socket",
+			    sockpath);
+		unlink(sockpath);
+	}
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(EX_CANTCREAT, "can't bind to '%s'", sockpath);
+	if (listen(s, 8) == -1)
+		err(EX_OSERR, "listen");
+	/* Stay in the directory a relative socket path is in. */
+	if (debuglevel == 0 && daemon(1, 0) == -1)
+		err(EX_OSERR, "daemon");
+	/* Memory locks aren't inherited by the daemon. */
+	if (realtime)
+		set_realtime();
+
+	/*
+	 * Signals to stop are blocked other than while waiting for input,
+	 * so that one arriving in between can't be missed.
+	 */
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGTERM);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGHUP);
+	sigprocmask(SIG_BLOCK, &stop, &serve_mask);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_quit;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	debug(1, "serving on %s", sockpath);
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while (!quit) {
+		start = hd44780_now();
+		n = ppoll(&pfd, 1, NULL, &serve_mask);
+		state->hd_stats.idle_ns += hd44780_now() - start;
+		if (n == -1) {
+			if (errno != EINTR)
+				warn("poll");
+			continue;
+		}
+		if ((c = accept(s, NULL, NULL)) == -1) {
+			warn("accept");
+			continue;
+		}
+		state->esc = 0;
+		do_input(state, c, s);
+		close(c);
+	}
+	close(s);
+	unlink(sockpath);
+}
+
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1)
+			err(EX_IOERR, "write");
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Pass the arguments, or standard input, on to the server.
+ */
+static void
+send_to_server(char *sockpath, int argc, char *argv[])
+{
+	struct sockaddr_un sun;
+	char buf[BUFSIZ];
+	ssize_t n;
+	int i, s;
+
+	if ((s = sock_addr(&sun, sockpath)) == -1)
+		err(EX_OSERR, "socket");
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(EX_UNAVAILABLE, "can't connect to '%s'", sockpath);
+	if (argc > 0) {
+		for (i = 0; i < argc; i++)
+			write_all(s, argv[i], strlen(argv[i]));
+	} else {
+		while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+			write_all(s, buf, n);
+	}
+	close(s);
+}
+
+/*
+ * Find where the newest frame in the buffer starts, frames start with a
+ * form feed.  Returns 0 if there is none past the start of the buffer.
+ */
+static ssize_t
+last_frame(const char *buf, ssize_t n)
+{
+	ssize_t i;
+
+	for (i = n - 1; i > 0; i--) {
+		if (buf[i] == '\f' && buf[i - 1] != '\033')
+			return (i);
+	}
+	return (0);
+}
+
+/*
+ * Read input in blocks and feed it to the display.  The display is only
+ * brought up to date once all the input available so far is consumed.
+ * Serving clients, lfd is the listening socket, an idle client gives way
+ * to the next one connecting.
+ *
+ * When coalescing, a frame is complete once the next one starts, at the
+ * end of input, or when no more of it arrives for HD_FRAME_IDLE_MS.  The
+ * last frame read is held back until then so that it isn't shown torn,
+ * and of the frames completed by a read only the newest is shown.
+ */
+static void
+do_input(struct hd44780_state *state, int fd, int lfd)
+{
+	char buf[2 * BUFSIZ];
+	uint64_t start;
+	ssize_t begin, end, held, n, i;
+	int ready;
+
+	held = n = 0;
+	for (;;) {
+		start = hd44780_now();
+		ready = wait_input(fd, lfd, held > 0 ? HD_FRAME_IDLE_MS : -1);
+		if (ready == -1) {
+			state->hd_stats.idle_ns += hd44780_now() - start;
+			if (!quit)
+				debug(1, "client idle, next one connecting");
+			break;
+		}
+		if (ready == 0) {
+			state->hd_stats.idle_ns += hd44780_now() - start;
+			for (i = 0; i < held; i++)
+				do_char(state, buf[i]);
+			held = 0;
+			hd44780_flush(state);
+			continue;
+		}
+		n = read(fd, buf + held, sizeof(buf) - held);
+		state->hd_stats.idle_ns += hd44780_now() - start;
+		if (n <= 0)
+			break;
+		n += held;
+		held = 0;
+		begin = 0;
+		end = n;
+		if (state->hd_coalesce) {
+			/* Hold back an incomplete frame, unless too long. */
+			if ((end = last_frame(buf, n)) == 0 && n < BUFSIZ) {
+				held = n;
+				continue;
+			}
+			if (end == 0)
+				end = n;
+			if ((begin = last_frame(buf, end)) > 0) {
+				debug(2, "skipping %zd bytes of older frames",
+				    begin);
+				state->esc = 0;
+			}
+		}
+		for (i = begin; i < end; i++)
+			do_char(state, buf[i]);
+		if (end < n) {
+			held = n - end;
+			memmove(buf, buf + end, held);
+		}
+		if (!input_pending(fd, 0))
+			hd44780_flush(state);
+	}
+	if (n == -1 && errno != EINTR)
+		warn("read");
+	for (i = 0; i < held; i++)
+		do_char(state, buf[i]);
+	hd44780_flush(state);
+}
+
 static void
 do_char(struct hd44780_state *state, char ch)
 {
-	static int	esc = 0;
 
-	if (esc) {
+	state->hd_stats.chars++;
+	if (state->esc) {
 		switch(ch) {
 		case 'R':
 			hd44780_command(state, CMD_RESET);
@@ -333,12 +1116,12 @@ do_char(struct hd44780_state *state, char ch)
 			hd44780_command(state, CMD_HOME);
 			break;
 		}
-		esc = 0;
+		state->esc = 0;
 		return;
 	}
 
 	if (ch == 27) {
-		esc = 1;
+		state->esc = 1;
 		return;
 	}
 
@@ -368,174 +1151,1718 @@ do_char(struct hd44780_state *state, char ch)
 	}
 }
 
-static void
-hd44780_set_pin(struct hd44780_state *state, enum hd_pin_id pin, bool on)
+/*
+ * Find the chip of a pin, by the name it was given as.
+ */
+static int
+hd44780_gpio_chip(gpio_pins *gpio, const char *name)
 {
-	int err;
+	int c;
 
-	assert(state->pins[pin] != -1);
-	err = gpiod_line_set_value(state->hd_gpio.lines[state->pins[pin]], on);
-	if (err != 0)
-		debug(1, "%s: error %d", __func__, errno);
+	name = chip_name(name);
+	for (c = 0; c < gpio->nchips; c++) {
+		if (strcmp(gpio->name[c], name) == 0)
+			return (c);
+	}
+	gpio->name[c] = name;
+	return (gpio->nchips++);
 }
 
-static void
-hd44780_strobe(struct hd44780_state *state)
+#if GPIOD_API >= 2
+/*
+ * Build the configuration for the lines on a chip.  Outputs keep their
+ * last written values, data lines are made inputs when reading.
+ */
+static struct gpiod_line_config *
+hd44780_gpio_config(struct hd44780_state *state, int c, bool data_output)
 {
-	usleep(20);
-	hd44780_set_pin(state, HD_PIN_E, true);
-	usleep(40);
-	hd44780_set_pin(state, HD_PIN_E, false);
-	usleep(20);
+	gpio_pins *gpio = &state->hd_gpio;
+	struct gpiod_line_settings *settings;
+	struct gpiod_line_config *config;
+	unsigned int offset;
+	int i;
+
+	settings = gpiod_line_settings_new();
+	config = gpiod_line_config_new();
+	if (settings == NULL || config == NULL)
+		err(EX_OSERR, "can't allocate line config");
+
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if ((gpio->pinmask[c] & HD_PIN_BIT(i)) == 0)
+			continue;
+		if (!data_output && i >= HD_PIN_DAT0 && i <= HD_PIN_DAT7) {
+			gpiod_line_settings_set_direction(settings,
+			    GPIOD_LINE_DIRECTION_INPUT);
+		} else {
+			gpiod_line_settings_set_direction(settings,
+			    GPIOD_LINE_DIRECTION_OUTPUT);
+			gpiod_line_settings_set_output_value(settings,
+			    gpio->values[i]);
+		}
+		offset = state->pins[i];
+		if (gpiod_line_config_add_line_settings(config, &offset, 1,
+		    settings) != 0)
+			err(1, "configuring pin %d failed", state->pins[i]);
+	}
+	gpiod_line_settings_free(settings);
+	return (config);
 }
 
-/* FIXME: hardcoded to 4-bit data interface. */
+/*
+ * Write the pins in the mask, all on one chip, with a single call.
+ */
 static void
-hd44780_output(struct hd44780_state *state, enum reg_type type, uint8_t data)
+hd44780_gpio_write(struct hd44780_state *state, int c, unsigned int mask,
+    unsigned int bits)
 {
+	gpio_pins *gpio = &state->hd_gpio;
+	unsigned int offsets[HD_PIN_COUNT];
+	enum gpiod_line_value values[HD_PIN_COUNT];
+	size_t n;
 	int i;
 
-	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
-
-	hd44780_set_pin(state, HD_PIN_RW, false);
-
-	if (type == HD_COMMAND)
-		hd44780_set_pin(state, HD_PIN_RS, false);
-	else
-		hd44780_set_pin(state, HD_PIN_RS, true);
-
-	/* Set upper nibble of data. */
-	for (i = 0; i < 4; i++) {
-		hd44780_set_pin(state, HD_PIN_DAT0 + i,
-		    ((1 << (i + 4)) & data) != 0);
+	n = 0;
+	for (; mask != 0; mask &= mask - 1) {
+		i = ffs(mask) - 1;
+		assert(state->pins[i] != -1);
+		gpio->values[i] = (bits & HD_PIN_BIT(i)) != 0 ?
+		    GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE;
+		offsets[n] = state->pins[i];
+		values[n] = gpio->values[i];
+		n++;
 	}
+	if (n == 0)
+		return;
+	state->hd_stats.syscalls++;
+	if (gpiod_line_request_set_values_subset(gpio->req[c], n, offsets,
+	    values) != 0)
+		hd44780_bus_error(state, __func__);
+}
 
-	hd44780_strobe(state);
-
-	/* Set lower nibble of data. */
-	for (i = 0; i < 4; i++) {
-		hd44780_set_pin(state, HD_PIN_DAT0 + i,
-		    ((1 << i) & data) != 0);
+/*
+ * Set all pins in the mask to the corresponding bits of the value
+ * with a single write per chip.  E goes last and on its own, so that
+ * everything else is settled on the other chips when it changes.
+ */
+static void
+hd44780_gpio_set_pins(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	unsigned int e = HD_PIN_BIT(HD_PIN_E);
+	int c;
+
+	for (c = 0; c < gpio->nchips; c++)
+		hd44780_gpio_write(state, c, mask & ~e & gpio->pinmask[c],
+		    bits);
+	if ((mask & e) != 0)
+		hd44780_gpio_write(state, gpio->chipid[HD_PIN_E], e, bits);
+}
+
+/*
+ * Read the pins in the mask, with a single read per chip.
+ */
+static unsigned int
+hd44780_gpio_get_pins(struct hd44780_state *state, unsigned int mask)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	unsigned int offsets[HD_PIN_COUNT];
+	enum gpiod_line_value values[HD_PIN_COUNT];
+	unsigned int bits, m;
+	size_t n;
+	int c, i;
+
+	bits = 0;
+	for (c = 0; c < gpio->nchips; c++) {
+		if ((m = mask & gpio->pinmask[c]) == 0)
+			continue;
+		n = 0;
+		for (i = 0; i < HD_PIN_COUNT; i++) {
+			if ((m & HD_PIN_BIT(i)) != 0)
+				offsets[n++] = state->pins[i];
+		}
+		state->hd_stats.syscalls++;
+		if (gpiod_line_request_get_values_subset(gpio->req[c], n,
+		    offsets, values) != 0) {
+			hd44780_bus_error(state, __func__);
+			continue;
+		}
+		n = 0;
+		for (i = 0; i < HD_PIN_COUNT; i++) {
+			if ((m & HD_PIN_BIT(i)) == 0)
+				continue;
+			if (values[n++] == GPIOD_LINE_VALUE_ACTIVE)
+				bits |= HD_PIN_BIT(i);
+		}
+	}
+	return (bits);
+}
+
+/*
+ * Switch the data lines between driving the bus and letting the
+ * controller drive it.
+ */
+static void
+hd44780_gpio_data_dir(struct hd44780_state *state, bool output)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	struct gpiod_line_config *config;
+	int c;
+
+	for (c = 0; c < gpio->nchips; c++) {
+		if ((gpio->pinmask[c] & HD_PIN_DATA_MASK(8)) == 0)
+			continue;
+		config = hd44780_gpio_config(state, c, output);
+		state->hd_stats.syscalls++;
+		if (gpiod_line_request_reconfigure_lines(gpio->req[c],
+		    config) != 0)
+			hd44780_bus_error(state, __func__);
+		gpiod_line_config_free(config);
+	}
+}
+
+/*
+ * Request the lines on a chip as they are and make them outputs at the
+ * levels they were left at, so that nothing changes on the bus.
+ */
+static void
+hd44780_gpio_attach(struct hd44780_state *state, int c,
+    struct gpiod_request_config *reqcfg)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	struct gpiod_line_settings *settings;
+	struct gpiod_line_config *config;
+	unsigned int offsets[HD_PIN_COUNT];
+	enum gpiod_line_value values[HD_PIN_COUNT];
+	size_t n;
+	int i;
+
+	settings = gpiod_line_settings_new();
+	config = gpiod_line_config_new();
+	if (settings == NULL || config == NULL)
+		err(EX_OSERR, "can't allocate line config");
+	gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_AS_IS);
+	n = 0;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if ((gpio->pinmask[c] & HD_PIN_BIT(i)) != 0)
+			offsets[n++] = state->pins[i];
+	}
+	if (gpiod_line_config_add_line_settings(config, offsets, n,
+	    settings) != 0)
+		err(1, "configuring pins on '%s' failed", gpio->name[c]);
+	gpio->req[c] = gpiod_chip_request_lines(gpio->chip[c], reqcfg,
+	    config);
+	if (gpio->req[c] == NULL)
+		err(1, "requesting pins on '%s' failed", gpio->name[c]);
+	gpiod_line_settings_free(settings);
+	gpiod_line_config_free(config);
+
+	if (gpiod_line_request_get_values_subset(gpio->req[c], n, offsets,
+	    values) != 0)
+		err(1, "reading pins on '%s' failed", gpio->name[c]);
+	n = 0;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if ((gpio->pinmask[c] & HD_PIN_BIT(i)) == 0)
+			continue;
+		gpio->values[i] = values[n++];
+		if (gpio->values[i] == GPIOD_LINE_VALUE_ACTIVE)
+			state->hd_bus_bits |= HD_PIN_BIT(i);
+	}
+
+	config = hd44780_gpio_config(state, c, true);
+	if (gpiod_line_request_reconfigure_lines(gpio->req[c], config) != 0)
+		err(1, "configuring pins on '%s' as outputs failed",
+		    gpio->name[c]);
+	gpiod_line_config_free(config);
+}
+
+static void
+hd44780_gpio_open(char *devname, struct hd44780_state *state)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	struct gpiod_request_config *reqcfg;
+	struct gpiod_line_config *config;
+	char path[PATH_MAX];
+	int c, i;
+
+	/* Group the lines by chip, all driven low unless attaching. */
+	gpio->nchips = 0;
+	memset(gpio->pinmask, 0, sizeof(gpio->pinmask));
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		gpio->values[i] = GPIOD_LINE_VALUE_INACTIVE;
+		if (state->pins[i] == -1)
+			continue;
+		c = hd44780_gpio_chip(gpio, state->pinchip[i] != NULL ?
+		    state->pinchip[i] : devname);
+		gpio->chipid[i] = c;
+		gpio->pinmask[c] |= HD_PIN_BIT(i);
+	}
+
+	if ((reqcfg = gpiod_request_config_new()) == NULL)
+		err(EX_OSERR, "can't allocate request config");
+	gpiod_request_config_set_consumer(reqcfg, progname);
+	for (c = 0; c < gpio->nchips; c++) {
+		/* Accept chip names as well as paths, like libgpiod v1 did. */
+		snprintf(path, sizeof(path), "%s%s",
+		    strchr(gpio->name[c], '/') == NULL ? "/dev/" : "",
+		    gpio->name[c]);
+		if ((gpio->chip[c] = gpiod_chip_open(path)) == NULL)
+			err(EX_OSFILE, "can't open '%s'", path);
+
+		if (state->hd_attach) {
+			hd44780_gpio_attach(state, c, reqcfg);
+			continue;
+		}
+
+		/* Request the lines as outputs. */
+		config = hd44780_gpio_config(state, c, true);
+		gpio->req[c] = gpiod_chip_request_lines(gpio->chip[c], reqcfg,
+		    config);
+		if (gpio->req[c] == NULL)
+			err(1, "configuring pins on '%s' as outputs failed",
+			    path);
+		gpiod_line_config_free(config);
+	}
+	gpiod_request_config_free(reqcfg);
+}
+
+static void
+hd44780_gpio_close(struct hd44780_state *state)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	int c;
+
+	for (c = 0; c < gpio->nchips; c++) {
+		gpiod_line_request_release(gpio->req[c]);
+		gpiod_chip_close(gpio->chip[c]);
+	}
+}
+#else
+/*
+ * Write the pins in the mask with a single write per bulk.
+ */
+static void
+hd44780_gpio_write(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	bool dirty[HD_BULK_MAX] = { false };
+	int b, err, i;
+
+	for (; mask != 0; mask &= mask - 1) {
+		i = ffs(mask) - 1;
+		assert(gpio->idx[i] != -1);
+		b = gpio->bulkid[i];
+		gpio->values[b][gpio->idx[i]] = (bits & HD_PIN_BIT(i)) != 0;
+		dirty[b] = true;
+	}
+	for (b = 0; b < HD_BULK(gpio->nchips, 0); b++) {
+		if (!dirty[b])
+			continue;
+		state->hd_stats.syscalls++;
+		err = gpiod_line_set_value_bulk(&gpio->bulk[b],
+		    gpio->values[b]);
+		if (err != 0)
+			hd44780_bus_error(state, __func__);
+	}
+}
+
+/*
+ * Set all pins in the mask to the corresponding bits of the value
+ * with a single write per bulk.  E goes last and on its own, so that
+ * everything else is settled on the other chips when it changes.
+ */
+static void
+hd44780_gpio_set_pins(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+	unsigned int e = HD_PIN_BIT(HD_PIN_E);
+
+	hd44780_gpio_write(state, mask & ~e, bits);
+	if ((mask & e) != 0)
+		hd44780_gpio_write(state, e, bits);
+}
+
+/*
+ * Read the pins in the mask, they all must be in data bulks.
+ */
+static unsigned int
+hd44780_gpio_get_pins(struct hd44780_state *state, unsigned int mask)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	int values[HD_BULK_MAX][HD_PIN_COUNT];
+	bool read[HD_BULK_MAX] = { false };
+	unsigned int bits;
+	int b, i;
+
+	bits = 0;
+	for (; mask != 0; mask &= mask - 1) {
+		i = ffs(mask) - 1;
+		b = gpio->bulkid[i];
+		assert(b % 2 == HD_BULK_DATA);
+		if (!read[b]) {
+			state->hd_stats.syscalls++;
+			if (gpiod_line_get_value_bulk(&gpio->bulk[b],
+			    values[b]) != 0) {
+				hd44780_bus_error(state, __func__);
+				memset(values[b], 0, sizeof(values[b]));
+			}
+			read[b] = true;
+		}
+		if (values[b][gpio->idx[i]])
+			bits |= HD_PIN_BIT(i);
+	}
+	return (bits);
+}
+
+/*
+ * Switch the data lines between driving the bus and letting the
+ * controller drive it.
+ */
+static void
+hd44780_gpio_data_dir(struct hd44780_state *state, bool output)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	int b, err;
+
+	for (b = HD_BULK_DATA; b < HD_BULK(gpio->nchips, 0); b += 2) {
+		if (gpio->bulk[b].num_lines == 0)
+			continue;
+		state->hd_stats.syscalls++;
+		if (output)
+			err = gpiod_line_set_direction_output_bulk(
+			    &gpio->bulk[b], gpio->values[b]);
+		else
+			err = gpiod_line_set_direction_input_bulk(
+			    &gpio->bulk[b]);
+		if (err != 0)
+			hd44780_bus_error(state, __func__);
+	}
+}
+
+static void
+hd44780_gpio_open(char *devname, struct hd44780_state *state)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	struct gpiod_line_request_config asis = {
+		progname, GPIOD_LINE_REQUEST_DIRECTION_AS_IS, 0
+	};
+	struct gpiod_line *line;
+	int b, c, error, i;
+
+	/* Group the lines by chip. */
+	gpio->nchips = 0;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if (state->pins[i] == -1)
+			continue;
+		gpio->chipid[i] = hd44780_gpio_chip(gpio,
+		    state->pinchip[i] != NULL ? state->pinchip[i] : devname);
+	}
+	for (c = 0; c < gpio->nchips; c++) {
+		if ((gpio->chip[c] = gpiod_chip_open_lookup(gpio->name[c])) ==
+		    NULL)
+			err(EX_OSFILE, "can't open '%s'", gpio->name[c]);
+	}
+
+	/* Get all the lines */
+	memset(gpio->values, 0, sizeof(gpio->values));
+	for (b = 0; b < HD_BULK_MAX; b++)
+		gpiod_line_bulk_init(&gpio->bulk[b]);
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		gpio->idx[i] = -1;
+		if (state->pins[i] == -1)
+			continue;
+		c = gpio->chipid[i];
+		if ((line = gpiod_chip_get_line(gpio->chip[c],
+		    state->pins[i])) == NULL)
+			err(EX_OSFILE, "can't open line '%d' on '%s'",
+			    state->pins[i], gpio->name[c]);
+		b = HD_BULK(c, HD_BULK_CTL);
+		if (state->hd_busyflag && i >= HD_PIN_DAT0 && i <= HD_PIN_DAT7)
+			b = HD_BULK(c, HD_BULK_DATA);
+		gpio->bulkid[i] = b;
+		gpio->idx[i] = gpio->bulk[b].num_lines;
+		gpiod_line_bulk_add(&gpio->bulk[b], line);
+	}
+
+	/*
+	 * Request them as outputs, all driven low.  When attaching take
+	 * them as they are and keep the levels they were left at.
+	 */
+	for (b = 0; b < HD_BULK(gpio->nchips, 0); b++) {
+		if (gpio->bulk[b].num_lines == 0)
+			continue;
+		if (!state->hd_attach) {
+			error = gpiod_line_request_bulk_output(&gpio->bulk[b],
+			    progname, gpio->values[b]);
+			if (error != 0)
+				err(1, "configuring pins as outputs failed");
+			continue;
+		}
+		error = gpiod_line_request_bulk(&gpio->bulk[b], &asis, NULL);
+		if (error == 0)
+			error = gpiod_line_get_value_bulk(&gpio->bulk[b],
+			    gpio->values[b]);
+		if (error == 0)
+			error = gpiod_line_set_direction_output_bulk(
+			    &gpio->bulk[b], gpio->values[b]);
+		if (error != 0)
+			err(1, "configuring pins as outputs failed");
+	}
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if (gpio->idx[i] != -1 && gpio->values[gpio->bulkid[i]][gpio->idx[i]])
+			state->hd_bus_bits |= HD_PIN_BIT(i);
+	}
+}
+
+static void
+hd44780_gpio_close(struct hd44780_state *state)
+{
+	gpio_pins *gpio = &state->hd_gpio;
+	int c;
+
+	for (c = 0; c < gpio->nchips; c++)
+		gpiod_chip_close(gpio->chip[c]);
+}
+#endif
+
+static void
+hd44780_i2c_flush(struct hd44780_state *state)
+{
+	i2c_expander *i2c = &state->hd_i2c;
+	struct i2c_msg msg;
+	struct i2c_rdwr_ioctl_data rdwr;
+
+	if (i2c->len == 0)
+		return;
+	msg.addr = i2c->addr;
+	msg.flags = 0;
+	msg.len = i2c->len;
+	msg.buf = i2c->buf;
+	rdwr.msgs = &msg;
+	rdwr.nmsgs = 1;
+	state->hd_stats.syscalls++;
+	if (ioctl(i2c->fd, I2C_RDWR, &rdwr) < 0)
+		hd44780_bus_error(state, __func__);
+	i2c->len = 0;
+}
+
+static void
+hd44780_i2c_queue(struct hd44780_state *state, uint8_t port)
+{
+	i2c_expander *i2c = &state->hd_i2c;
+
+	if (i2c->len == sizeof(i2c->buf))
+		hd44780_i2c_flush(state);
+	i2c->buf[i2c->len++] = port;
+	i2c->port = port;
+}
+
+/*
+ * Port bits for a bus state, from the tables built when opening.
+ */
+static uint8_t
+hd44780_i2c_port(i2c_expander *i2c, unsigned int bits)
+{
+
+	return (i2c->datamap[bits & HD_PIN_DATA_MASK(8)] |
+	    i2c->ctlmap[bits >> HD_PIN_RS]);
+}
+
+static void
+hd44780_i2c_set_pins(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+	i2c_expander *i2c = &state->hd_i2c;
+
+	hd44780_i2c_queue(state, (i2c->port & ~hd44780_i2c_port(i2c, mask)) |
+	    hd44780_i2c_port(i2c, bits & mask));
+}
+
+static unsigned int
+hd44780_i2c_get_pins(struct hd44780_state *state, unsigned int mask)
+{
+	i2c_expander *i2c = &state->hd_i2c;
+	struct i2c_msg msg;
+	struct i2c_rdwr_ioctl_data rdwr;
+	unsigned int bits;
+	uint8_t port;
+	int i;
+
+	hd44780_i2c_flush(state);
+	msg.addr = i2c->addr;
+	msg.flags = I2C_M_RD;
+	msg.len = 1;
+	msg.buf = &port;
+	rdwr.msgs = &msg;
+	rdwr.nmsgs = 1;
+	state->hd_stats.syscalls++;
+	if (ioctl(i2c->fd, I2C_RDWR, &rdwr) < 0) {
+		hd44780_bus_error(state, __func__);
+		return (0);
+	}
+	bits = 0;
+	for (i = 0; i < HD_PIN_COUNT; i++) {
+		if ((mask & HD_PIN_BIT(i)) == 0)
+			continue;
+		if ((port & (1 << state->pins[i])) != 0)
+			bits |= HD_PIN_BIT(i);
+	}
+	return (bits);
+}
+
+/*
+ * PCF8574 ports are quasi-bidirectional, a port written high can be
+ * pulled low by the controller and read back.
+ */
+static void
+hd44780_i2c_data_dir(struct hd44780_state *state, bool output)
+{
+	unsigned int mask;
+
+	if (output)
+		return;
+	mask = HD_PIN_DATA_MASK(state->hd_ifwidth);
+	hd44780_i2c_set_pins(state, mask, mask);
+}
+
+/*
+ * Queue idle port writes to let at least usec pass on the bus, the write
+ * that follows accounts for one byte time.
+ */
+static void
+hd44780_i2c_pad(struct hd44780_state *state, useconds_t usec)
+{
+	i2c_expander *i2c = &state->hd_i2c;
+	int n;
+
+	n = (usec + i2c->byte_usec - 1) / i2c->byte_usec - 1;
+	while (n-- > 0)
+		hd44780_i2c_queue(state, i2c->port);
+}
+
+/*
+ * Find out the bus clock from the device tree, if it's not there assume
+ * the fastest standard one to be on the safe side.
+ */
+static int
+hd44780_i2c_byte_usec(char *devname)
+{
+	char path[PATH_MAX];
+	uint8_t freq[4];
+	uint32_t hz;
+	char *cp;
+	int fd, n;
+
+	hz = 400000;
+	cp = strrchr(devname, '/');
+	snprintf(path, sizeof(path),
+	    "/sys/class/i2c-dev/%s/device/of_node/clock-frequency",
+	    cp != NULL ? cp + 1 : devname);
+	if ((fd = open(path, O_RDONLY)) != -1) {
+		if (read(fd, freq, sizeof(freq)) == sizeof(freq))
+			hz = freq[0] << 24 | freq[1] << 16 | freq[2] << 8 |
+			    freq[3];
+		close(fd);
+	}
+	debug(1, "I2C bus clock %u Hz", hz);
+
+	/* 8 data bits and acknowledge */
+	n = 9 * 1000000 / hz;
+	return (n > 0 ? n : 1);
+}
+
+static void
+hd44780_i2c_open(char *devname, struct hd44780_state *state)
+{
+	i2c_expander *i2c = &state->hd_i2c;
+	unsigned int mask = 0;
+	int i, v;
+
+	if ((i2c->fd = open(devname, O_RDWR)) == -1)
+		err(EX_OSFILE, "can't open '%s'", devname);
+	i2c->byte_usec = hd44780_i2c_byte_usec(devname);
+	i2c->len = 0;
+
+	for (v = 0; v < 256; v++) {
+		i2c->datamap[v] = 0;
+		for (i = 0; i < 8; i++) {
+			if ((v & (1 << i)) != 0 &&
+			    state->pins[HD_PIN_DAT0 + i] != -1)
+				i2c->datamap[v] |= 1 << state->pins[HD_PIN_DAT0 + i];
+		}
 	}
+	for (v = 0; v < 16; v++) {
+		i2c->ctlmap[v] = 0;
+		for (i = 0; i < 4; i++) {
+			if ((v & (1 << i)) != 0 && state->pins[HD_PIN_RS + i] != -1)
+				i2c->ctlmap[v] |= 1 << state->pins[HD_PIN_RS + i];
+		}
+	}
+
+	/* All outputs driven low, or left as they are when attaching. */
+	if (state->hd_attach) {
+		for (i = 0; i < HD_PIN_COUNT; i++) {
+			if (state->pins[i] != -1)
+				mask |= HD_PIN_BIT(i);
+		}
+		state->hd_bus_bits = hd44780_i2c_get_pins(state, mask);
+		i2c->port = hd44780_i2c_port(i2c, state->hd_bus_bits);
+		return;
+	}
+	hd44780_i2c_queue(state, 0);
+	hd44780_i2c_flush(state);
+}
+
+static void
+hd44780_i2c_close(struct hd44780_state *state)
+{
+
+	hd44780_i2c_flush(state);
+	close(state->hd_i2c.fd);
+}
+
+/*
+ * Monotonic time in nanoseconds.
+ */
+/*
+ * A failed bus access isn't fatal, the display may recover with the next
+ * frame.  Count it for -t.
+ */
+static void
+hd44780_bus_error(struct hd44780_state *state, const char *func)
+{
+
+	state->hd_stats.errors++;
+	debug(1, "%s: error %d", func, errno);
+}
+
+static uint64_t
+hd44780_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Compute the bus state for a register write with the given nibble
+ * (4-bit interface) or byte (8-bit interface) on the data pins.
+ */
+static unsigned int
+hd44780_bus_value(enum reg_type type, uint8_t value, int width)
+{
+	unsigned int bits;
+
+	bits = (type == HD_DATA) ? HD_PIN_BIT(HD_PIN_RS) : 0;
+	return (bits | ((value << HD_PIN_DAT0) & HD_PIN_DATA_MASK(width)));
+}
+
+/*
+ * Extract the nibble or byte from a bus state read back from the data pins.
+ */
+static uint8_t
+hd44780_bus_data(unsigned int bits, int width)
+{
+
+	return ((bits & HD_PIN_DATA_MASK(width)) >> HD_PIN_DAT0);
+}
+
+static void
+hd44780_sim_set_pins(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+	sim_bus *sim = &state->hd_sim;
+
+	sim->bits = (sim->bits & ~mask) | (bits & mask);
+	sim->writes++;
+}
+
+static unsigned int
+hd44780_sim_get_pins(struct hd44780_state *state, unsigned int mask)
+{
+	sim_bus *sim = &state->hd_sim;
+	unsigned int bits;
+
+	bits = sim->bits;
+	if (sim->data_in)
+		bits &= ~HD_PIN_DATA_MASK(8);
+	sim->reads++;
+	return (bits & mask);
+}
+
+static void
+hd44780_sim_data_dir(struct hd44780_state *state, bool output)
+{
+
+	state->hd_sim.data_in = !output;
+}
+
+static void
+hd44780_sim_open(char *devname, struct hd44780_state *state)
+{
+
+	memset(&state->hd_sim, 0, sizeof(state->hd_sim));
+}
+
+static void
+hd44780_sim_close(struct hd44780_state *state)
+{
+
+	debug(1, "sim: %lu writes, %lu reads", state->hd_sim.writes,
+	    state->hd_sim.reads);
+}
+
+/*
+ * Translate between the data pins and the controller's DB0-7, with the
+ * 4-bit interface only DB4-7 are wired.
+ */
+static uint8_t
+hd44780_emu_db(struct hd44780_state *state, unsigned int bits)
+{
+	uint8_t db;
+
+	db = hd44780_bus_data(bits, state->hd_ifwidth);
+	return (state->hd_ifwidth == 4 ? db << 4 : db);
+}
+
+static unsigned int
+hd44780_emu_pins(struct hd44780_state *state, uint8_t db)
+{
+
+	return (hd44780_bus_value(HD_COMMAND,
+	    state->hd_ifwidth == 4 ? db >> 4 : db, state->hd_ifwidth));
+}
+
+static void
+hd44780_emu_check(hd_emu *emu, const char *what, uint64_t ns,
+    unsigned int min)
+{
+
+	if (ns >= min)
+		return;
+	emu->timing_errs++;
+	debug(1, "emu: %s %llu ns, needs %u ns", what,
+	    (unsigned long long)ns, min);
+}
+
+/*
+ * Step the address counter, DDRAM lines wrap into each other.  Stepping
+ * from an address past the lines, which a set address can leave it at,
+ * is kept within DDRAM as well.
+ */
+static void
+hd44780_emu_step(hd_emu *emu, bool incr)
+{
+	uint8_t last;
+
+	if (emu->cgsel) {
+		emu->ac = (emu->ac + (incr ? 1 : -1)) & (HD_EMU_CGRAM_SIZE - 1);
+		return;
+	}
+	if ((emu->mode & HD_MODE_2LINES) == 0) {
+		last = 2 * HD_LINE_DRAM_SIZE - 1;
+		if (incr)
+			emu->ac = (emu->ac == last) ? 0 : emu->ac + 1;
+		else
+			emu->ac = (emu->ac == 0) ? last : emu->ac - 1;
+	} else if (incr) {
+		last = HD_LINE1_DRAM_OFFSET + HD_LINE_DRAM_SIZE - 1;
+		if (emu->ac == HD_LINE_DRAM_SIZE - 1)
+			emu->ac = HD_LINE1_DRAM_OFFSET;
+		else
+			emu->ac = (emu->ac == last) ? 0 : emu->ac + 1;
+	} else {
+		last = HD_LINE1_DRAM_OFFSET + HD_LINE_DRAM_SIZE - 1;
+		if (emu->ac == HD_LINE1_DRAM_OFFSET)
+			emu->ac = HD_LINE_DRAM_SIZE - 1;
+		else
+			emu->ac = (emu->ac == 0) ? last : emu->ac - 1;
+	}
+	emu->ac &= HD_EMU_DDRAM_SIZE - 1;
+}
+
+/*
+ * Execute a register write.
+ */
+static void
+hd44780_emu_exec(struct hd44780_state *state, bool rs, uint8_t val)
+{
+	const struct hd_timing *t = state->hd_timing;
+	hd_emu *emu = &state->hd_emu;
+	unsigned int busy_us;
+	bool incr;
+
+	incr = (emu->entry & HD_ENTRY_INCR) != 0;
+	busy_us = t->exec_us;
+	if (rs) {
+		emu->writes++;
+		busy_us = t->data_us;
+		if (emu->cgsel) {
+			emu->cgram[emu->ac] = val;
+		} else {
+			emu->ddram[emu->ac] = val;
+			if ((emu->entry & HD_DISP_SHIFT) != 0)
+				emu->shift += incr ? 1 : -1;
+		}
+		hd44780_emu_step(emu, incr);
+	} else if ((val & HD_CMD_SET_ADDR) != 0) {
+		emu->cgsel = false;
+		emu->ac = val & ~HD_CMD_SET_ADDR;
+	} else if ((val & HD_CMD_SET_CGADDR) != 0) {
+		emu->cgsel = true;
+		emu->ac = val & ~HD_CMD_SET_CGADDR;
+	} else if ((val & HD_CMD_SETMODE) != 0) {
+		emu->mode = val;
+		emu->if8 = (val & HD_MODE_8BIT_IF) != 0;
+		emu->lownib = false;
+		/* The first two after power on take longer. */
+		if (emu->fsets == 0)
+			busy_us = t->reset1_us;
+		else if (emu->fsets == 1)
+			busy_us = t->reset2_us;
+		emu->fsets++;
+	} else if ((val & HD_CMD_MOVE) != 0) {
+		if ((val & HD_MOVE_DISP) != 0)
+			emu->shift += (val & HD_MOVE_RIGHT) ? -1 : 1;
+		else
+			hd44780_emu_step(emu, (val & HD_MOVE_RIGHT) != 0);
+	} else if ((val & HD_CMD_DISPCTRL) != 0) {
+		emu->dispctl = val;
+	} else if ((val & HD_CMD_ENTRYMODE) != 0) {
+		emu->entry = val;
+	} else if ((val & HD_CMD_HOME) != 0) {
+		emu->cgsel = false;
+		emu->ac = 0;
+		emu->shift = 0;
+		busy_us = t->home_us;
+	} else if ((val & HD_CMD_CLEAR) != 0) {
+		memset(emu->ddram, ' ', sizeof(emu->ddram));
+		emu->cgsel = false;
+		emu->ac = 0;
+		emu->shift = 0;
+		emu->entry |= HD_ENTRY_INCR;
+		busy_us = t->clear_us;
+	}
+	if (!rs)
+		emu->instrs++;
+	debug(3, "emu: %s 0x%02x", rs ? "data" : "cmd ", val);
+	emu->busy_until = hd44780_now() + (uint64_t)busy_us * 1000;
+}
+
+/*
+ * Start a read on E rising, the register is latched for both nibbles.
+ */
+static void
+hd44780_emu_read(struct hd44780_state *state, bool rs, uint64_t now)
+{
+	hd_emu *emu = &state->hd_emu;
+
+	if (emu->lownib && !emu->if8)
+		return;
+	if (!rs) {
+		emu->out = emu->ac;
+		if (now < emu->busy_until)
+			emu->out |= HD_BUSY_FLAG;
+		return;
+	}
+	if (now < emu->busy_until) {
+		emu->busy_errs++;
+		debug(1, "emu: data read while busy");
+	}
+	emu->out = emu->cgsel ? emu->cgram[emu->ac] : emu->ddram[emu->ac];
+	emu->reads++;
+}
+
+/*
+ * Latch a write, or finish a read, on E falling.
+ */
+static void
+hd44780_emu_latch(struct hd44780_state *state, bool rs, bool rw,
+    uint64_t now)
+{
+	hd_emu *emu = &state->hd_emu;
+	uint8_t db;
+
+	if (!rw && now < emu->busy_until) {
+		emu->busy_errs++;
+		debug(1, "emu: write while busy for another %llu ns",
+		    (unsigned long long)(emu->busy_until - now));
+	}
+	db = hd44780_emu_db(state, emu->bits);
+	if (!emu->if8 && !emu->lownib) {
+		emu->hinib = db & 0xf0;
+		emu->lownib = true;
+		return;
+	}
+	emu->lownib = false;
+	if (rw) {
+		if (rs)
+			hd44780_emu_step(emu,
+			    (emu->entry & HD_ENTRY_INCR) != 0);
+		return;
+	}
+	hd44780_emu_exec(state, rs, emu->if8 ? db : emu->hinib | db >> 4);
+}
+
+static void
+hd44780_emu_set_pins(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+	const struct hd_timing *t = state->hd_timing;
+	hd_emu *emu = &state->hd_emu;
+	unsigned int changed, ctl, e;
+	uint64_t now;
+	bool rs, rw;
+
+	/* The pins change while the write is in progress, take the start. */
+	now = state->hd_bus_time;
+	changed = emu->bits ^ ((emu->bits & ~mask) | (bits & mask));
+	emu->bits ^= changed;
+	ctl = HD_PIN_BIT(HD_PIN_RS) | HD_PIN_BIT(HD_PIN_RW);
+	e = HD_PIN_BIT(HD_PIN_E);
+	rs = (emu->bits & HD_PIN_BIT(HD_PIN_RS)) != 0;
+	rw = (emu->bits & HD_PIN_BIT(HD_PIN_RW)) != 0;
+
+	if ((changed & (ctl | HD_PIN_DATA_MASK(8))) != 0) {
+		if ((emu->bits & e) != 0 && (changed & ctl) != 0) {
+			emu->timing_errs++;
+			debug(1, "emu: RS or R/W changed while E is high");
+		} else if (emu->t_fall != 0) {
+			hd44780_emu_check(emu, "hold", now - emu->t_fall,
+			    t->hold_ns);
+		}
+		if ((changed & ctl) != 0)
+			emu->t_ctl = now;
+	}
+	if ((changed & e) == 0)
+		return;
+	if ((emu->bits & e) != 0) {
+		hd44780_emu_check(emu, "address setup", now - emu->t_ctl,
+		    t->setup_ns);
+		if (emu->t_rise != 0)
+			hd44780_emu_check(emu, "E cycle", now - emu->t_rise,
+			    t->cycle_ns);
+		emu->t_rise = now;
+		if (rw)
+			hd44780_emu_read(state, rs, now);
+	} else {
+		hd44780_emu_check(emu, "E pulse", now - emu->t_rise,
+		    t->pulse_ns);
+		emu->t_fall = now;
+		hd44780_emu_latch(state, rs, rw, now);
+	}
+}
+
+static unsigned int
+hd44780_emu_get_pins(struct hd44780_state *state, unsigned int mask)
+{
+	hd_emu *emu = &state->hd_emu;
+	unsigned int bits;
+	uint8_t db;
+
+	bits = emu->bits;
+	if (emu->data_in) {
+		db = emu->out;
+		if (!emu->if8)
+			db = emu->lownib ? db << 4 : db & 0xf0;
+		bits &= ~HD_PIN_DATA_MASK(8);
+		bits |= hd44780_emu_pins(state, db);
+	}
+	return (bits & mask);
+}
+
+static void
+hd44780_emu_data_dir(struct hd44780_state *state, bool output)
+{
+
+	state->hd_emu.data_in = !output;
+}
+
+/*
+ * Power on: 8-bit interface, one line, display off, incrementing, and
+ * busy until the power on time has passed.
+ */
+static void
+hd44780_emu_open(char *devname, struct hd44780_state *state)
+{
+	hd_emu *emu = &state->hd_emu;
+
+	memset(emu, 0, sizeof(*emu));
+	memset(emu->ddram, ' ', sizeof(emu->ddram));
+	emu->if8 = true;
+	emu->mode = HD_CMD_SETMODE | HD_MODE_8BIT_IF;
+	emu->entry = HD_CMD_ENTRYMODE | HD_ENTRY_INCR;
+	emu->dispctl = HD_CMD_DISPCTRL;
+	emu->t_ctl = hd44780_now();
+	emu->busy_until = emu->t_ctl +
+	    (uint64_t)state->hd_timing->power_on_us * 1000;
+}
+
+/*
+ * Show what the display would, CGRAM characters as '#'.
+ */
+static void
+hd44780_emu_close(struct hd44780_state *state)
+{
+	hd_emu *emu = &state->hd_emu;
+	int col, len, line, pos, row;
+	uint8_t c;
+
+	len = (emu->mode & HD_MODE_2LINES) ? HD_LINE_DRAM_SIZE :
+	    2 * HD_LINE_DRAM_SIZE;
+	for (row = 0; row < state->hd_lines; row++) {
+		line = (emu->mode & HD_MODE_2LINES) ? row & 1 : 0;
+		putchar('|');
+		for (col = 0; col < state->hd_cols; col++) {
+			pos = ((row >> 1) * state->hd_cols + col + emu->shift) %
+			    len;
+			if (pos < 0)
+				pos += len;
+			c = emu->ddram[line * HD_LINE1_DRAM_OFFSET + pos];
+			if ((emu->dispctl & HD_DISP_ON) == 0)
+				c = ' ';
+			else if (c < 8)
+				c = '#';
+			else if (!isprint(c))
+				c = '.';
+			putchar(c);
+		}
+		printf("|\n");
+	}
+	debug(1, "emu: %lu instructions, %lu data writes, %lu data reads",
+	    emu->instrs, emu->writes, emu->reads);
+	if (emu->busy_errs != 0 || emu->timing_errs != 0)
+		warnx("emu: %lu accesses while busy, %lu timing violations",
+		    emu->busy_errs, emu->timing_errs);
+}
+
+static const struct hd_bus hd_bus_gpiod = {
+	.name = "gpiod",
+	.device = DEFAULT_DEVICE,
+	.open = hd44780_gpio_open,
+	.close = hd44780_gpio_close,
+	.set_pins = hd44780_gpio_set_pins,
+	.get_pins = hd44780_gpio_get_pins,
+	.data_dir = hd44780_gpio_data_dir,
+};
+
+static const struct hd_bus hd_bus_i2c = {
+	.name = "i2c",
+	.device = DEFAULT_I2C_DEVICE,
+	.open = hd44780_i2c_open,
+	.close = hd44780_i2c_close,
+	.set_pins = hd44780_i2c_set_pins,
+	.get_pins = hd44780_i2c_get_pins,
+	.data_dir = hd44780_i2c_data_dir,
+	.flush = hd44780_i2c_flush,
+	.pad = hd44780_i2c_pad,
+};
+
+static const struct hd_bus hd_bus_sim = {
+	.name = "sim",
+	.open = hd44780_sim_open,
+	.close = hd44780_sim_close,
+	.set_pins = hd44780_sim_set_pins,
+	.get_pins = hd44780_sim_get_pins,
+	.data_dir = hd44780_sim_data_dir,
+};
+
+static const struct hd_bus hd_bus_emu = {
+	.name = "emu",
+	.open = hd44780_emu_open,
+	.close = hd44780_emu_close,
+	.set_pins = hd44780_emu_set_pins,
+	.get_pins = hd44780_emu_get_pins,
+	.data_dir = hd44780_emu_data_dir,
+};
+
+static const struct hd_bus *hd_buses[] = {
+	&hd_bus_gpiod,
+	&hd_bus_i2c,
+	&hd_bus_sim,
+	&hd_bus_emu,
+	NULL
+};
+
+static const struct hd_bus *
+hd44780_bus_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; hd_buses[i] != NULL; i++) {
+		if (strcasecmp(name, hd_buses[i]->name) == 0)
+			return (hd_buses[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Set all pins in the mask to the corresponding bits of the value, only
+ * those that change are written.
+ */
+static void
+hd44780_set_pins(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+
+	mask &= (bits ^ state->hd_bus_bits) | ~state->hd_bus_known;
+	if (mask == 0)
+		return;
+	state->hd_bus_bits = (state->hd_bus_bits & ~mask) | (bits & mask);
+	state->hd_bus_known |= mask;
+	state->hd_stats.writes++;
+	state->hd_bus_time = hd44780_now();
+	state->hd_bus->set_pins(state, mask, bits);
+}
+
+/*
+ * Read the pins in the mask.
+ */
+static unsigned int
+hd44780_get_pins(struct hd44780_state *state, unsigned int mask)
+{
 
-	hd44780_strobe(state);
+	state->hd_stats.reads++;
+	return (state->hd_bus->get_pins(state, mask));
 }
 
+/*
+ * Switch the data lines between driving the bus and letting the
+ * controller drive it.
+ */
 static void
-hd44780_output4(struct hd44780_state *state, enum reg_type type, uint8_t data)
+hd44780_data_dir(struct hd44780_state *state, bool output)
 {
-	int i;
 
-	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
+	/* Don't know what released data lines will be driven to later. */
+	if (!output)
+		state->hd_bus_known &= ~HD_PIN_DATA_MASK(8);
+	state->hd_stats.dirs++;
+	state->hd_bus->data_dir(state, output);
+}
 
-	hd44780_set_pin(state, HD_PIN_RW, false);
+/*
+ * Push out anything queued for the bus.
+ */
+static void
+hd44780_bus_flush(struct hd44780_state *state)
+{
 
-	if (type == HD_COMMAND)
-		hd44780_set_pin(state, HD_PIN_RS, false);
-	else
-		hd44780_set_pin(state, HD_PIN_RS, true);
+	if (state->hd_bus->flush != NULL)
+		state->hd_bus->flush(state);
+}
+
+/*
+ * Sleep, pushing out anything queued for the bus first.
+ */
+static void
+hd44780_sleep(struct hd44780_state *state, useconds_t usec)
+{
+
+	hd44780_bus_flush(state);
+	state->hd_stats.syscalls++;
+	state->hd_stats.sleeps++;
+	state->hd_stats.wait_ns += (uint64_t)usec * 1000;
+	usleep(usec);
+}
+
+/*
+ * Sleep until the given monotonic time, pushing out anything queued for
+ * the bus first.
+ */
+static void
+hd44780_sleep_until(struct hd44780_state *state, uint64_t deadline)
+{
+	struct timespec ts;
+	uint64_t now, wake;
+
+	hd44780_bus_flush(state);
+
+	/*
+	 * Short waits are mostly sleep and wakeup overhead, spin through
+	 * them.  Longer ones sleep, waking up early enough to spin through
+	 * the rest.
+	 */
+	now = hd44780_now();
+	if (now >= deadline)
+		return;
+	state->hd_stats.wait_ns += deadline - now;
+	if (deadline - now > (uint64_t)state->hd_spin_us * 1000) {
+		wake = deadline;
+		if (state->hd_spin_us > 0)
+			wake -= state->hd_wake_ns;
+		ts.tv_sec = wake / 1000000000;
+		ts.tv_nsec = wake % 1000000000;
+		state->hd_stats.sleeps++;
+		do
+			state->hd_stats.syscalls++;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+		    NULL) == EINTR);
+	}
+	while (hd44780_now() < deadline)
+		;
+}
 
-	/* Set upper nibble of data. */
-	for (i = 0; i < 4; i++) {
-		hd44780_set_pin(state, HD_PIN_DAT0 + i,
-		    ((1 << (i + 4)) & data) != 0);
+/*
+ * Measure how late a sleep wakes up against the raw clock, to know how
+ * much of a longer wait to spin through.  Can't be more than the spin
+ * threshold since shorter waits spin anyway.
+ */
+static void
+hd44780_calibrate(struct hd44780_state *state)
+{
+	struct timespec req, t0, t1;
+	uint64_t late, ns;
+	int i;
+
+	if (state->hd_spin_us == 0)
+		return;
+	req.tv_sec = 0;
+	req.tv_nsec = 100000;
+	late = 0;
+	for (i = 0; i < 5; i++) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+		nanosleep(&req, NULL);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+		ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+		    t1.tv_nsec - t0.tv_nsec;
+		if (ns > (uint64_t)req.tv_nsec)
+			late = MAX(late, ns - req.tv_nsec);
 	}
+	state->hd_wake_ns = MIN(late, (uint64_t)state->hd_spin_us * 1000);
+	debug(1, "sleeps wake up %u ns late", state->hd_wake_ns);
+}
 
-	hd44780_strobe(state);
+/*
+ * Let the time pass unless it already has.
+ */
+static void
+hd44780_wait_until(struct hd44780_state *state, uint64_t deadline)
+{
+
+	if (hd44780_now() < deadline)
+		hd44780_sleep_until(state, deadline);
 }
 
+/*
+ * Bus timing, let ns pass since the last pin write was issued.  The pins
+ * change while the write is in progress, and a GPIO write takes longer
+ * than any of these, so this has usually passed already.  What is left is
+ * far too short to sleep through.
+ */
 static void
-hd44780_prepare(char *devname, struct hd44780_state *state)
+hd44780_wait_bus(struct hd44780_state *state, unsigned int ns)
 {
-	int error, i;
+	uint64_t deadline, now;
 
-	if ((state->hd_gpio.chip = gpiod_chip_open_lookup(devname)) == NULL)
-		err(EX_OSFILE, "can't open '%s'", devname);
+	deadline = state->hd_bus_time + ns;
+	if ((now = hd44780_now()) >= deadline)
+		return;
+	state->hd_stats.wait_ns += deadline - now;
+	while (hd44780_now() < deadline)
+		;
+}
 
-	/* Get all the lines */
-	for (i = 0; i < HD_PIN_COUNT; i++) {
-		if (state->pins[i] == -1)
-			continue;
-		if ((state->hd_gpio.lines[state->pins[i]] = gpiod_chip_get_line(state->hd_gpio.chip, state->pins[i])) == NULL)
-			err(EX_OSFILE, "can't open line '%d'", state->pins[i]);
+static void
+hd44780_set_pin(struct hd44780_state *state, enum hd_pin_id pin, bool on)
+{
+
+	hd44780_set_pins(state, HD_PIN_BIT(pin), on ? HD_PIN_BIT(pin) : 0);
+}
+
+/*
+ * Set RS, R/W and data, and strobe them into the controller.
+ */
+static void
+hd44780_strobe(struct hd44780_state *state, unsigned int mask,
+    unsigned int bits)
+{
+	const struct hd_timing *t = state->hd_timing;
+	unsigned int ctl;
+
+	/*
+	 * Queued writes each take longer than any of these delays.  Only RS
+	 * and R/W need to be set up before E rises, the data is latched on
+	 * E falling, so unless RS or R/W change it goes out along with E.
+	 */
+	if (state->hd_bus->flush != NULL) {
+		ctl = mask & (HD_PIN_BIT(HD_PIN_RW) | HD_PIN_BIT(HD_PIN_RS));
+		if ((state->hd_bus_known & ctl) == ctl &&
+		    ((bits ^ state->hd_bus_bits) & ctl) == 0)
+			hd44780_set_pins(state, mask | HD_PIN_BIT(HD_PIN_E),
+			    bits | HD_PIN_BIT(HD_PIN_E));
+		else {
+			hd44780_set_pins(state, mask, bits);
+			hd44780_set_pin(state, HD_PIN_E, true);
+		}
+		hd44780_set_pin(state, HD_PIN_E, false);
+		return;
 	}
 
-	for (i = 0; i < HD_PIN_COUNT; i++) {
-		if (state->pins[i] == -1)
-			continue;
-		error = gpiod_line_request_output(state->hd_gpio.lines[state->pins[i]], progname, 0);
-		if (error != 0)
-			err(1, "configuring pin %d as output failed",
-			    state->pins[i]);
+	hd44780_set_pins(state, mask, bits);
+	hd44780_wait_bus(state, t->setup_ns);
+	hd44780_set_pin(state, HD_PIN_E, true);
+	hd44780_wait_bus(state, t->pulse_ns);
+	hd44780_set_pin(state, HD_PIN_E, false);
+	hd44780_wait_bus(state, MAX(t->hold_ns, t->cycle_ns - t->pulse_ns));
+}
+
+/*
+ * Read a register, for HD_COMMAND this is the busy flag and the address
+ * counter.
+ */
+static uint8_t
+hd44780_input(struct hd44780_state *state, enum reg_type type)
+{
+	const struct hd_timing *t = state->hd_timing;
+	unsigned int bits, mask;
+	uint8_t data;
+	int i, width;
+
+	hd44780_data_dir(state, false);
+	bits = HD_PIN_BIT(HD_PIN_RW);
+	if (type == HD_DATA)
+		bits |= HD_PIN_BIT(HD_PIN_RS);
+	hd44780_set_pins(state, HD_PIN_BIT(HD_PIN_RW) | HD_PIN_BIT(HD_PIN_RS),
+	    bits);
+	hd44780_wait_bus(state, t->setup_ns);
+
+	/* With the 4-bit interface upper nibble comes first. */
+	width = state->hd_ifwidth;
+	mask = HD_PIN_DATA_MASK(width);
+	data = 0;
+	for (i = 0; i < 8 / width; i++) {
+		hd44780_set_pin(state, HD_PIN_E, true);
+		hd44780_wait_bus(state, t->pulse_ns);
+		bits = hd44780_get_pins(state, mask);
+		data = (data << width) | hd44780_bus_data(bits, width);
+		hd44780_set_pin(state, HD_PIN_E, false);
+		hd44780_wait_bus(state, t->cycle_ns - t->pulse_ns);
 	}
 
-	for (i = 0; i < HD_PIN_COUNT; i++) {
-		if (state->pins[i] == -1)
-			continue;
+	hd44780_set_pin(state, HD_PIN_RW, false);
+	hd44780_data_dir(state, true);
+
+	debug(3, "%s <- 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
+	return (data);
+}
 
-		hd44780_set_pin(state, i, false);
+/*
+ * Wait until the controller is done with the previous instruction.
+ * If the busy flag never clears R/W is probably not connected, so give up
+ * on it and go back to fixed delays.
+ */
+static void
+hd44780_wait_busy(struct hd44780_state *state)
+{
+	uint64_t limit;
+
+	if (!state->hd_busyflag || !state->hd_bf_ready) {
+		hd44780_wait_until(state, state->hd_busy_until);
+		return;
 	}
+	/* Polls can be quick, bound the wait by time rather than count. */
+	limit = hd44780_now() + (uint64_t)state->hd_timing->clear_us * 10000;
+	do {
+		if ((hd44780_input(state, HD_COMMAND) & HD_BUSY_FLAG) == 0)
+			return;
+	} while (hd44780_now() < limit);
+	warnx("busy flag stuck, falling back to fixed delays");
+	state->hd_busyflag = 0;
+	hd44780_sleep(state, state->hd_timing->clear_us);
+}
 
-	usleep(20000);
-	hd44780_command(state, CMD_RESET);
+/*
+ * Note that the controller is busy for usec from now.  Nothing waits
+ * here, hd44780_wait_busy() does before the next access, so whatever
+ * comes in between overlaps with the controller executing.
+ * Over I2C short waits are covered by padding the queued port writes.
+ */
+static void
+hd44780_delay(struct hd44780_state *state, useconds_t usec)
+{
+	uint64_t until;
 
-	if (state->hd_bl_on)
-		hd44780_set_pin(state, HD_PIN_BL, true);
+	if (state->hd_busyflag && state->hd_bf_ready)
+		return;
+	if (state->hd_bus->flush != NULL) {
+		if (usec <= HD_I2C_PAD_USEC) {
+			state->hd_bus->pad(state, usec);
+			return;
+		}
+		/* The time only starts once the queue is on the bus. */
+		state->hd_bus->flush(state);
+	}
+	until = hd44780_now() + (uint64_t)usec * 1000;
+	if (until > state->hd_busy_until)
+		state->hd_busy_until = until;
 }
 
 static void
-hd44780_finish(void)
+hd44780_output(struct hd44780_state *state, enum reg_type type, uint8_t data)
 {
-	gpiod_chip_close(hd44780_state.hd_gpio.chip);
+	unsigned int mask;
+
+	hd44780_wait_busy(state);
+	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
+	if (type == HD_DATA && state->hd_stats.first == 0)
+		state->hd_stats.first = hd44780_now();
+
+	mask = HD_PIN_BIT(HD_PIN_RW) | HD_PIN_BIT(HD_PIN_RS) |
+	    HD_PIN_DATA_MASK(state->hd_ifwidth);
+
+	if (state->hd_ifwidth == 8) {
+		/* Set R/W, R/S and all of data in one go. */
+		hd44780_strobe(state, mask, hd44780_bus_value(type, data, 8));
+		return;
+	}
+
+	/* Set R/W, R/S and upper nibble of data. */
+	hd44780_strobe(state, mask, hd44780_bus_value(type, data >> 4, 4));
+
+	/* Set lower nibble of data. */
+	hd44780_strobe(state, mask, hd44780_bus_value(type, data & 0x0f, 4));
 }
 
-#define	HD_CMD_CLEAR			0x01
+/*
+ * Write with a single strobe: only the upper nibble of data with the 4-bit
+ * interface, the whole of it with the 8-bit one.  This is needed for
+ * the reset sequence while the interface width is not yet known.
+ */
+static void
+hd44780_output4(struct hd44780_state *state, enum reg_type type, uint8_t data)
+{
+	unsigned int mask;
 
-#define	HD_CMD_HOME			0x02
+	hd44780_wait_busy(state);
+	debug(3, "%s -> 0x%02x", (type == HD_COMMAND) ? "cmd " : "data", data);
 
-#define	HD_CMD_ENTRYMODE		0x04
-#define		HD_ENTRY_INCR		0x02
-#define		HD_DISP_SHIFT		0x01
+	mask = HD_PIN_BIT(HD_PIN_RW) | HD_PIN_BIT(HD_PIN_RS) |
+	    HD_PIN_DATA_MASK(state->hd_ifwidth);
 
-#define	HD_CMD_DISPCTRL			0x08
-#define		HD_DISP_ON		0x04
-#define		HD_CURSOR_ON		0x02
-#define		HD_BLINK_ON		0x01
+	if (state->hd_ifwidth == 8) {
+		hd44780_strobe(state, mask, hd44780_bus_value(type, data, 8));
+	} else {
+		/* Set R/W, R/S and upper nibble of data. */
+		hd44780_strobe(state, mask,
+		    hd44780_bus_value(type, data >> 4, 4));
+	}
+}
 
-#define	HD_CMD_MOVE			0x10
-#define		HD_MOVE_DISP		0x08
-#define		HD_MOVE_CURSOR		0x00
-#define		HD_MOVE_RIGHT		0x04
-#define		HD_MOVE_LEFT		0x00
+static void
+hd44780_prepare(char *devname, struct hd44780_state *state)
+{
+	state->hd_fb = malloc(state->hd_lines * state->hd_cols);
+	state->hd_ddram = malloc(state->hd_lines * state->hd_cols);
+	if (state->hd_fb == NULL || state->hd_ddram == NULL)
+		err(EX_OSERR, "can't allocate screen buffers");
+
+	/* Buses with a device drive a display that outlives us. */
+	if (state->hd_bus->device != NULL)
+		hd44780_state_path(state, devname);
+
+	state->hd_bus_bits = 0;
+	state->hd_bus->open(devname, state);
+	state->hd_bus_known = ~0u;
+
+	if (state->hd_attach && hd44780_state_load(state)) {
+		/* No time to calibrate, spin through all of the threshold. */
+		state->hd_wake_ns = state->hd_spin_us * 1000;
+		state->hd_bf_ready = 1;
+		state->hd_addr = -1;
+		memset(state->hd_fb, ' ', state->hd_lines * state->hd_cols);
+	} else {
+		hd44780_delay(state, state->hd_timing->power_on_us);
+		hd44780_calibrate(state);
+		hd44780_command(state, CMD_RESET);
+	}
+	/* Written again once the display is left in a known state. */
+	if (state->hd_statefile[0] != '\0')
+		unlink(state->hd_statefile);
 
-#define	HD_CMD_SETMODE			0x20
-#define		HD_MODE_8BIT_IF		0x10
-#define		HD_MODE_2LINES		0x08
-#define		HD_MODE_LARGE_FONT	0x04
+	if (state->pins[HD_PIN_BL] != -1)
+		hd44780_set_pin(state, HD_PIN_BL, state->hd_bl_on);
+}
 
-#define	HD_CMD_SET_CGADDR		0x40
+/*
+ * The state file records the setup and contents of the display, so that
+ * the next run can attach to it.
+ */
+static void
+hd44780_state_path(struct hd44780_state *state, char *devname)
+{
+	char *cp;
+
+	cp = strrchr(devname, '/');
+	cp = (cp != NULL) ? cp + 1 : devname;
+	if (state->hd_i2c.addr != -1)
+		snprintf(state->hd_statefile, sizeof(state->hd_statefile),
+		    HD_STATE_DIR "/%s-%s-%02x.state", progname, cp,
+		    state->hd_i2c.addr);
+	else
+		snprintf(state->hd_statefile, sizeof(state->hd_statefile),
+		    HD_STATE_DIR "/%s-%s.state", progname, cp);
+}
 
-#define	HD_CMD_SET_ADDR			0x80
+static void
+hd44780_state_header(struct hd44780_state *state, char *buf, size_t len)
+{
+	size_t n;
+	int i;
 
-#define	HD_LINE_DRAM_SIZE		40
-#define	HD_LINE1_DRAM_OFFSET		0x40
+	n = snprintf(buf, len, "%s %dx%d %d-bit font %d cursor %d blink %d "
+	    "pins", state->hd_bus->name, state->hd_cols, state->hd_lines,
+	    state->hd_ifwidth, state->hd_font, state->hd_cursor,
+	    state->hd_blink);
+	for (i = 0; i < HD_PIN_COUNT && n < len; i++)
+		n += snprintf(buf + n, len - n, " %s%s%d",
+		    state->pinchip[i] != NULL ? state->pinchip[i] : "",
+		    state->pinchip[i] != NULL ? ":" : "", state->pins[i]);
+	if (n < len)
+		snprintf(buf + n, len - n, "\n");
+}
+
+/*
+ * Take the display contents from the state file, if it describes the
+ * display as set up now.
+ */
+static bool
+hd44780_state_load(struct hd44780_state *state)
+{
+	char want[256], have[256];
+	size_t size;
+	bool ok;
+	FILE *fp;
+
+	if (state->hd_statefile[0] == '\0')
+		return (false);
+	if ((fp = fopen(state->hd_statefile, "r")) == NULL)
+		return (false);
+	hd44780_state_header(state, want, sizeof(want));
+	size = state->hd_lines * state->hd_cols;
+	ok = fgets(have, sizeof(have), fp) != NULL &&
+	    strcmp(have, want) == 0 &&
+	    fread(state->hd_ddram, 1, size, fp) == size;
+	fclose(fp);
+	debug(1, "%s: %s", state->hd_statefile,
+	    ok ? "attaching" : "different setup, resetting");
+	return (ok);
+}
+
+static void
+hd44780_state_save(struct hd44780_state *state)
+{
+	char header[256];
+	FILE *fp;
+
+	if (state->hd_statefile[0] == '\0')
+		return;
+	if ((fp = fopen(state->hd_statefile, "w")) == NULL) {
+		debug(1, "can't write %s: %s", state->hd_statefile,
+		    strerror(errno));
+		return;
+	}
+	hd44780_state_header(state, header, sizeof(header));
+	fputs(header, fp);
+	fwrite(state->hd_ddram, 1, state->hd_lines * state->hd_cols, fp);
+	if (fclose(fp) != 0)
+		unlink(state->hd_statefile);
+}
+
+static void
+hd44780_finish(void)
+{
+	struct hd44780_state *state = &hd44780_state;
+	struct hd_stats *st = &state->hd_stats;
+	const char *name = state->hd_bus->name;
+	double busy, run;
+
+	/*
+	 * A run attaching to the display writes right away, let the last
+	 * instruction finish before the lines are released.
+	 */
+	hd44780_wait_busy(state);
+	hd44780_bus_flush(state);
+	hd44780_state_save(state);
+	state->hd_bus->close(state);
+	if (!state->hd_showstats)
+		return;
+	busy = (hd44780_now() - st->start - st->idle_ns) / 1e9;
+	fprintf(stderr, "%s: %.3f s, %.3f s without input waits\n", name,
+	    (hd44780_now() - st->start) / 1e9, busy);
+	fprintf(stderr, "%s: %lu writes, %lu reads, %lu direction changes\n",
+	    name, st->writes, st->reads, st->dirs);
+	fprintf(stderr, "%s: %lu syscalls, %lu sleeps, %.3f ms waiting\n",
+	    name, st->syscalls, st->sleeps, st->wait_ns / 1e6);
+	if (st->errors > 0)
+		fprintf(stderr, "%s: %lu failed bus accesses\n", name,
+		    st->errors);
+	/* Leave out setting up the display, that's the first character. */
+	run = (hd44780_now() - st->ready - st->idle_ns) / 1e9;
+	if (st->chars > 0)
+		fprintf(stderr, "%s: %lu chars, %.0f chars/s, %.1f writes/char, "
+		    "%.1f syscalls/char after setup\n", name, st->chars,
+		    st->chars / run,
+		    (double)(st->writes - st->ready_writes) / st->chars,
+		    (double)(st->syscalls - st->ready_syscalls) / st->chars);
+	if (st->first != 0)
+		fprintf(stderr, "%s: first character after %.3f ms\n", name,
+		    (st->first - st->start) / 1e6);
+}
 
 static uint8_t
-hd44780_calc_addr(struct hd44780_state *state)
+hd44780_cell_addr(struct hd44780_state *state, int row, int col)
 {
 	uint8_t addr;
 
-	addr = state->hd_col;
-	if (state->hd_row == 1 || state->hd_row == 3)
+	addr = col;
+	if (row == 1 || row == 3)
 		addr += HD_LINE1_DRAM_OFFSET;
-	if (state->hd_row == 2 || state->hd_row == 3)
+	if (row == 2 || row == 3)
 		addr += state->hd_cols;
 	return (addr);
 }
 
+static uint8_t
+hd44780_calc_addr(struct hd44780_state *state)
+{
+
+	return (hd44780_cell_addr(state, state->hd_row, state->hd_col));
+}
+
+/*
+ * Address the controller moves to after a data write at the given address.
+ */
+static uint8_t
+hd44780_next_addr(struct hd44780_state *state, uint8_t addr)
+{
+
+	addr++;
+	if (state->hd_lines == 1) {
+		if (addr == 2 * HD_LINE_DRAM_SIZE)
+			addr = 0;
+	} else if (addr == HD_LINE_DRAM_SIZE) {
+		addr = HD_LINE1_DRAM_OFFSET;
+	} else if (addr == HD_LINE1_DRAM_OFFSET + HD_LINE_DRAM_SIZE) {
+		addr = 0;
+	}
+	return (addr);
+}
+
+static void
+hd44780_blank(struct hd44780_state *state)
+{
+
+	memset(state->hd_fb, ' ', state->hd_lines * state->hd_cols);
+	memset(state->hd_ddram, ' ', state->hd_lines * state->hd_cols);
+}
+
 static void
 hd44780_command(struct hd44780_state *state, enum command cmd)
 {
+	const struct hd_timing *t = state->hd_timing;
 	int i;
 	uint8_t	val;
 
@@ -550,16 +2877,20 @@ hd44780_command(struct hd44780_state *state, enum command cmd)
 
 		/*
 		 * This needs to be repeated three times to guarantee a state
-		 * where the desired mode can be configured.
+		 * where the desired mode can be configured.  The busy flag
+		 * can't be checked until the interface width is set, so
+		 * make sure whatever ran before has finished.
 		 */
+		hd44780_wait_busy(state);
+		state->hd_bf_ready = 0;
 		val = HD_CMD_SETMODE;
 		val |= HD_MODE_8BIT_IF;
 		hd44780_output4(state, HD_COMMAND, val);
-		usleep(10000);
+		hd44780_delay(state, t->reset1_us);
 		hd44780_output4(state, HD_COMMAND, val);
-		usleep(1000);
+		hd44780_delay(state, t->reset2_us);
 		hd44780_output4(state, HD_COMMAND, val);
-		usleep(1000);
+		hd44780_delay(state, t->exec_us);
 
 		val = HD_CMD_SETMODE;
 		if (state->hd_ifwidth == 8)
@@ -575,30 +2906,45 @@ hd44780_command(struct hd44780_state *state, enum command cmd)
 		 */
 		if (state->hd_ifwidth == 4)
 			hd44780_output4(state, HD_COMMAND, val);
+		state->hd_bf_ready = 1;
+		hd44780_delay(state, t->exec_us);
 
 		hd44780_output(state, HD_COMMAND, val);
-		usleep(10000);
+		hd44780_delay(state, t->exec_us);
 
 		val = HD_CMD_DISPCTRL;
 		hd44780_output(state, HD_COMMAND, val);
-		usleep(1000);
+		hd44780_delay(state, t->exec_us);
 		val |= HD_DISP_ON;
 		if (state->hd_cursor)
 			val |= HD_CURSOR_ON;
 		if (state->hd_blink)
 			val |= HD_BLINK_ON;
 		hd44780_output(state, HD_COMMAND, val);
-		usleep(1000);
+		hd44780_delay(state, t->exec_us);
 
 		val = HD_CMD_ENTRYMODE;
 		val |= HD_ENTRY_INCR;
 		hd44780_output(state, HD_COMMAND, val);
-		usleep(1000);
-		/* FALLTHROUGH */
+		hd44780_delay(state, t->exec_us);
 
-	case CMD_CLR:
+		/* Nothing is known about the contents, clear for real. */
 		hd44780_output(state, HD_COMMAND, HD_CMD_CLEAR);
-		usleep(2000);
+		hd44780_delay(state, t->clear_us);
+		hd44780_blank(state);
+		state->hd_addr = 0;
+		state->hd_col = 0;
+		state->hd_row = 0;
+		break;
+
+	case CMD_CLR:
+		/*
+		 * Only blank the frame buffer, hd44780_flush() decides
+		 * whether the clear instruction or overwriting what is
+		 * displayed gets there faster.
+		 */
+		memset(state->hd_fb, ' ', state->hd_lines * state->hd_cols);
+		state->hd_clear = 1;
 		state->hd_col = 0;
 		state->hd_row = 0;
 		break;
@@ -606,70 +2952,67 @@ hd44780_command(struct hd44780_state *state, enum command cmd)
 	case CMD_BKSP:
 		if (state->hd_col > 0) {
 			/*
-			 * Move the cursor back, overwrite with a space
-			 * and move back again.
+			 * Blank the previous cell and leave the cursor
+			 * there.  The flush writes the cell only if it
+			 * isn't blank on the display already, and moves a
+			 * visible cursor back with a single set address.
 			 */
-			hd44780_output(state, HD_COMMAND, HD_CMD_MOVE |
-			    HD_MOVE_CURSOR | HD_MOVE_LEFT);
-			state->hd_col--;	/* NB: putc increments hd_col */
-			hd44780_putc(state, ' ');
-			hd44780_output(state, HD_COMMAND, HD_CMD_MOVE |
-			    HD_MOVE_CURSOR | HD_MOVE_LEFT);
 			state->hd_col--;
+			state->hd_fb[state->hd_row * state->hd_cols +
+			    state->hd_col] = ' ';
 		} else {
 			/* XXX */
 			hd44780_command(state, CMD_FLASH);
 		}
-		usleep(1000);
 		break;
 
 	case CMD_NL:
 		/*
 		 * Fill the remainder of the current line with spaces.  If there
-		 * is no space for another line, then the cursor is held at the
-		 * end position.  This way no characters will be output until
-		 * the screen is cleared or the cursor is moved otherwise.
+		 * is no space for another line, then either scroll the frame
+		 * buffer up a line, the flush rewrites only the cells that
+		 * changed, or hold the cursor at the end position.  This way no
+		 * characters will be output until the screen is cleared or the
+		 * cursor is moved otherwise.
 		 */
-		while (state->hd_col < state->hd_cols)	/* NB: putc increments hd_col */
-			hd44780_putc(state, ' ');
+		hd44780_pad(state, state->hd_cols - state->hd_col);
 		if (state->hd_row < state->hd_lines - 1) {
 			state->hd_row++;
 			state->hd_col = 0;
-			val = hd44780_calc_addr(state);
-			hd44780_output(state, HD_COMMAND, HD_CMD_SET_ADDR | val);
-			usleep(1000);
+		} else if (state->hd_scroll) {
+			memmove(state->hd_fb, state->hd_fb + state->hd_cols,
+			    (state->hd_lines - 1) * state->hd_cols);
+			state->hd_col = 0;
+			hd44780_pad(state, state->hd_cols);
+			state->hd_col = 0;
 		}
 		break;
 
 	case CMD_CR:
 		state->hd_col = 0;
-		val = hd44780_calc_addr(state);
-		hd44780_output(state, HD_COMMAND, HD_CMD_SET_ADDR | val);
-		usleep(1000);
 		break;
 
 	case CMD_HOME:
-		/* just move to address 0, also resets display shift */
-		hd44780_output(state, HD_COMMAND, HD_CMD_HOME);
-		usleep(2000);
+		/*
+		 * The display is never shifted, so there is nothing for the
+		 * return home instruction to undo.  The address counter is
+		 * set when the next cell is written.
+		 */
 		state->hd_col = 0;
 		state->hd_row = 0;
 		break;
 
 	case CMD_TAB:
-		i = 8 - state->hd_col % 8;
-		if (state->hd_col + i > state->hd_cols)
-			i = state->hd_cols - state->hd_col;
-		while (i-- > 0)
-			hd44780_putc(state, ' ');
+		hd44780_pad(state, 8 - state->hd_col % 8);
 		break;
 
 	case CMD_FLASH:
 		/* Turn the display off and on a couple of times. */
+		hd44780_flush(state);
 		for (i = 0; i < 2; i++) {
 			val = HD_CMD_DISPCTRL;
 			hd44780_output(state, HD_COMMAND, val);
-			usleep(200000);
+			hd44780_sleep(state, 200000);
 			val |= HD_DISP_ON;
 			if (state->hd_cursor)
 				val |= HD_CURSOR_ON;
@@ -677,9 +3020,9 @@ hd44780_command(struct hd44780_state *state, enum command cmd)
 				val |= HD_BLINK_ON;
 			hd44780_output(state, HD_COMMAND, val);
 			if (i < 3)
-				usleep(200000);
+				hd44780_sleep(state, 200000);
 			else
-				usleep(1000);
+				hd44780_sleep(state, 1000);
 		}
 		break;
 
@@ -692,6 +3035,10 @@ hd44780_command(struct hd44780_state *state, enum command cmd)
 	}
 }
 
+/*
+ * Characters are only put into the frame buffer, hd44780_flush() sends
+ * them to the display.
+ */
 static void
 hd44780_putc(struct hd44780_state *state, int c)
 {
@@ -702,7 +3049,130 @@ hd44780_putc(struct hd44780_state *state, int c)
 	 */
 	if (state->hd_col == state->hd_cols)
 		return;
-	hd44780_output(state, HD_DATA, c);
-	usleep(40);
+	state->hd_fb[state->hd_row * state->hd_cols + state->hd_col] = c;
 	state->hd_col++;
 }
+
+/*
+ * Blank up to n cells from the cursor on, not beyond the end of the row.
+ * Only the frame buffer is touched, cells that are blank on the display
+ * already are skipped by the flush.
+ */
+static void
+hd44780_pad(struct hd44780_state *state, int n)
+{
+
+	if (n > state->hd_cols - state->hd_col)
+		n = state->hd_cols - state->hd_col;
+	memset(state->hd_fb + state->hd_row * state->hd_cols + state->hd_col,
+	    ' ', n);
+	state->hd_col += n;
+}
+
+/*
+ * Time in microseconds one instruction takes to execute and, on I2C, to
+ * get to the expander, two port writes per nibble.
+ */
+static unsigned int
+hd44780_instr_cost(struct hd44780_state *state, unsigned int exec_us)
+{
+
+	if (state->hd_bus->flush == NULL)
+		return (exec_us);
+	return (exec_us +
+	    2 * (8 / state->hd_ifwidth) * state->hd_i2c.byte_usec);
+}
+
+/*
+ * Time hd44780_flush() would take to bring the display from the given
+ * contents, NULL for blank, and address to the frame buffer.
+ */
+static unsigned int
+hd44780_flush_cost(struct hd44780_state *state, const uint8_t *shown,
+    int addr)
+{
+	const struct hd_timing *t = state->hd_timing;
+	unsigned int cost;
+	int row, col, cell;
+	uint8_t cur;
+
+	cost = 0;
+	for (row = 0; row < state->hd_lines; row++) {
+		for (col = 0; col < state->hd_cols; col++) {
+			cell = row * state->hd_cols + col;
+			cur = (shown != NULL) ? shown[cell] : ' ';
+			if (state->hd_fb[cell] == cur)
+				continue;
+			if (addr != hd44780_cell_addr(state, row, col))
+				cost += hd44780_instr_cost(state, t->exec_us);
+			cost += hd44780_instr_cost(state, t->data_us);
+			addr = hd44780_next_addr(state,
+			    hd44780_cell_addr(state, row, col));
+		}
+	}
+	return (cost);
+}
+
+/*
+ * Bring the display in sync with the frame buffer.  Only the cells that
+ * differ from what is already displayed are written, the address counter
+ * is set only when the next changed cell is not where it already points.
+ * After a clear, the clear instruction is used only if that and writing
+ * the new contents is faster than overwriting the old contents.
+ */
+static void
+hd44780_flush(struct hd44780_state *state)
+{
+	const struct hd_timing *t = state->hd_timing;
+	unsigned int hard, soft;
+	int row, col, cell;
+	uint8_t addr;
+
+	if (state->hd_clear) {
+		state->hd_clear = 0;
+		soft = hd44780_flush_cost(state, state->hd_ddram,
+		    state->hd_addr);
+		hard = hd44780_instr_cost(state, t->clear_us) +
+		    hd44780_flush_cost(state, NULL, 0);
+		debug(2, "clear: %u us overwriting, %u us clearing", soft,
+		    hard);
+		if (hard < soft) {
+			hd44780_output(state, HD_COMMAND, HD_CMD_CLEAR);
+			hd44780_delay(state, t->clear_us);
+			memset(state->hd_ddram, ' ',
+			    state->hd_lines * state->hd_cols);
+			state->hd_addr = 0;
+		}
+	}
+
+	for (row = 0; row < state->hd_lines; row++) {
+		for (col = 0; col < state->hd_cols; col++) {
+			cell = row * state->hd_cols + col;
+			if (state->hd_fb[cell] == state->hd_ddram[cell])
+				continue;
+			addr = hd44780_cell_addr(state, row, col);
+			if (state->hd_addr != addr) {
+				hd44780_output(state, HD_COMMAND,
+				    HD_CMD_SET_ADDR | addr);
+				hd44780_delay(state, t->exec_us);
+			}
+			hd44780_output(state, HD_DATA, state->hd_fb[cell]);
+			hd44780_delay(state, t->data_us);
+			state->hd_ddram[cell] = state->hd_fb[cell];
+			state->hd_addr = hd44780_next_addr(state, addr);
+		}
+	}
+
+	/* Leave the visible cursor where the next character would go. */
+	if (state->hd_cursor || state->hd_blink) {
+		addr = hd44780_calc_addr(state);
+		if (state->hd_addr != addr) {
+			hd44780_output(state, HD_COMMAND,
+			    HD_CMD_SET_ADDR | addr);
+			hd44780_delay(state, t->exec_us);
+			state->hd_addr = addr;
+		}
+	}
+
+	hd44780_bus_flush(state);
+}
@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# Run gpiolcd on a gpio-sim chip: create the chip through configfs, show
+# some text in a few configurations, sample the lines while gpiolcd holds
+# them and check that they are left as the last nibble written sets them,
+# run the bench scenarios on the chip and remove it again.  Needs root and
+# the gpio-sim module.
+#
+
+set -e
+
+CONFIGFS=/sys/kernel/config/gpio-sim
+SIM=$CONFIGFS/gpiolcd-$$
+GPIOLCD=${GPIOLCD:-./gpiolcd}
+MAKE=${MAKE:-make}
+TMP=${TMPDIR:-/tmp}/gpiosim-test.$$
+chip=
+
+cleanup() {
+	[ -z "$server" ] || kill $server 2>/dev/null || true
+	rm -f $TMP.sock $TMP.log
+	[ -z "$chip" ] || rm -f /run/$(basename $GPIOLCD)-$chip.state
+	[ -d $SIM ] || return 0
+	echo 0 >$SIM/live
+	rmdir $SIM/bank0 $SIM
+}
+trap cleanup EXIT
+trap 'exit 1' HUP INT TERM
+
+modprobe gpio-sim 2>/dev/null || true
+if [ ! -d $CONFIGFS ]; then
+	echo "$0: $CONFIGFS not found, is gpio-sim available?" >&2
+	exit 1
+fi
+mkdir $SIM $SIM/bank0
+echo 12 >$SIM/bank0/num_lines
+echo 1 >$SIM/live
+chip=$(cat $SIM/bank0/chip_name)
+lines=/sys/devices/platform/$(cat $SIM/dev_name)/$chip
+echo "== gpio-sim chip $chip"
+
+# Line levels as "line=value ...", for the lines given.
+levels() {
+	out=
+	for l in "$@"; do
+		out="$out${out:+ }$l=$(cat $lines/sim_gpio$l/value)"
+	done
+	echo "$out"
+}
+
+# Show text with a server, which keeps holding the lines so that they can
+# be sampled, and compare the levels with the expected ones.  Failed bus
+# accesses fail the check too.
+failed=0
+check() {
+	name=$1
+	want=$2
+	text=$3
+	shift 3
+	server=
+	$GPIOLCD -d -t -f $chip -S $TMP.sock "$@" 2>$TMP.log &
+	server=$!
+	i=0
+	while [ ! -S $TMP.sock ] && [ $i -lt 50 ]; do
+		sleep 0.1
+		i=$((i + 1))
+	done
+	$GPIOLCD -s $TMP.sock "$text"
+	sleep 0.2
+	have=$(levels $(echo "$want" | sed 's/=[01]//g'))
+	kill $server
+	wait $server || true
+	server=
+	if grep 'failed bus accesses' $TMP.log; then
+		echo "FAIL: $name: bus errors"
+		failed=1
+	elif [ "$have" != "$want" ]; then
+		echo "FAIL: $name: lines $have, want $want"
+		failed=1
+	else
+		echo "ok: $name"
+	fi
+}
+
+# Lines are RS 0, R/W 1, E 2, backlight 3 and data from 4 on.  After the
+# last character RS is high, R/W and E low, the data lines hold its low
+# nibble, or all of it in 8-bit mode.
+check "4-bit" "0=1 1=0 2=0 3=1 4=1 5=1 6=1 7=1" "Hello"
+check "4 lines" "0=1 1=0 2=0 3=1 4=0 5=0 6=1 7=0" \
+    "$(printf '1\n2\n3\n4')" -h 4 -w 20
+check "8-bit" "0=1 1=0 2=0 3=1 4=1 5=1 6=1 7=1 8=0 9=1 10=1 11=0" \
+    "Hello" -I 8
+check "data pins reversed" "0=1 1=0 2=0 3=1 4=0 5=0 6=0 7=1" \
+    "Hello!" -D 7,6,5,4
+check "busy flag" "0=1 1=0 2=0 3=1 4=1 5=1 6=1 7=1" "Hello" -P
+check "backlight off" "3=0" "Hello" -O
+
+$MAKE -s bench BENCH_FLAGS="-f $chip"
+exit $failed